@@ -0,0 +1,823 @@
+// Benchmarks of the overhead fuse++ adds to libfuse
+//
+// The operations are called straight from their libfuse tables, in
+// process: no kernel and no mount are involved.  libfuse's request context
+// and reply functions are replaced below by trivial stand-ins, so the
+// numbers are the cost of dispatching a request to the filesystem code.
+//
+// Each operation does the same work in every variant:
+//   raw       plain libfuse callbacks, no fuse++
+//   path_t    fuse, overriding the path_t operations
+//   string    fuse, overriding the std::string operations
+//   handle    fuse, reading and writing through a handle_t
+//   raw_ll    plain libfuse lowlevel callbacks
+//   lowlevel  fuse_lowlevel
+//
+// forget runs on the lowlevel variants only: it looks up a directory's
+// entries and forgets them again, lowlevel keeping them in an
+// inode_table.
+//
+// and, to see how the in-memory filesystem scales with threads:
+//   memfs     memfs, each thread on a file of its own, with 64 others
+//             in the same directory
+//
+// Read and write go through read_buf and write_buf when the table has
+// them, and otherwise through read and write the way libfuse does.
+//
+// With glibc, allocs is the number of calls to malloc, calloc and
+// realloc per operation, counting the buffer libfuse allocates for
+// read, which the reply frees.
+//
+// usage: bench [iterations [max threads]]
+//        bench --check [iterations [max threads]]
+//
+// --check runs only getattr, read, write and forget, and exits with 1 if
+// any of them allocates more than expected once its thread is warmed
+// up, or if the inode table is left with inodes.  Nothing should
+// allocate but the bufvec and its data that libfuse frees after a
+// high-level read, and inode_table's list of the inodes a batch of
+// forgets removes.  It exits with 77 where allocations are not counted.
+//
+// Build with optimization, e.g. cmake -DCMAKE_BUILD_TYPE=Release.
+
+#define FUSE_USE_VERSION 30
+
+#include "fuse++"
+#include "fuse++_inode_table"
+#include "fuse++_memfs"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+
+#if __cplusplus < 201103L
+#define override
+#endif
+
+/* the work, shared by all the variants */
+
+static const size_t entry_count = 64;
+static char entry_names[entry_count][16];
+static char data[1 << 20];
+
+static int work_getattr(size_t size, struct stat *st) {
+  memset(st, 0, sizeof(*st));
+  st->st_mode = S_IFREG | 0644;
+  st->st_size = size;
+  return 0;
+}
+static int work_read(char *buf, size_t count, off_t offset) {
+  memcpy(buf, data + offset, count);
+  return count;
+}
+static int work_write(const char *, size_t count, off_t) { return count; }
+static uint64_t entry_inos[entry_count];
+static void work_lookup(const char *name, struct fuse_entry_param *e) {
+  memset(e, 0, sizeof(*e));
+  // a number of its own for each name
+  uint64_t ino = 2;
+  for (const char *c = name; *c; ++c) {
+    ino = ino * 31 + (unsigned char)*c;
+  }
+  e->ino = ino;
+  work_getattr(strlen(name), &e->attr);
+  e->attr.st_ino = ino;
+  e->attr_timeout = 1.0;
+  e->entry_timeout = 1.0;
+}
+
+/* libfuse stand-ins */
+
+static __thread struct fuse_context bench_context;
+static __thread void *bench_userdata;
+static struct fuse_ctx bench_ctx;
+
+struct fuse_context *fuse_get_context(void) { return &bench_context; }
+
+void *fuse_req_userdata(fuse_req_t) { return bench_userdata; }
+const struct fuse_ctx *fuse_req_ctx(fuse_req_t) { return &bench_ctx; }
+int fuse_reply_err(fuse_req_t, int) { return 0; }
+int fuse_reply_attr(fuse_req_t, const struct stat *, double) { return 0; }
+int fuse_reply_buf(fuse_req_t, const char *, size_t) { return 0; }
+int fuse_reply_write(fuse_req_t, size_t) { return 0; }
+int fuse_reply_entry(fuse_req_t, const struct fuse_entry_param *) { return 0; }
+void fuse_reply_none(fuse_req_t) {}
+size_t fuse_add_direntry(fuse_req_t, char *buf, size_t bufsize,
+                         const char *name, const struct stat *, off_t) {
+  size_t namelen = strlen(name);
+  size_t entlen = (24 + namelen + 7) & ~(size_t)7;
+  if (buf && entlen <= bufsize) {
+    memcpy(buf + 24, name, namelen);
+  }
+  return entlen;
+}
+
+/* allocation counting */
+
+#ifdef __GLIBC__
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+}
+
+static __thread size_t allocations;
+
+void *malloc(size_t size) {
+  ++allocations;
+  return __libc_malloc(size);
+}
+void *calloc(size_t count, size_t size) {
+  ++allocations;
+  return __libc_calloc(count, size);
+}
+void *realloc(void *ptr, size_t size) {
+  ++allocations;
+  return __libc_realloc(ptr, size);
+}
+#define COUNTING_ALLOCATIONS 1
+#else
+static size_t allocations;
+#endif
+
+static int filler(void *, const char *, const struct stat *, off_t,
+                  enum fuse_fill_dir_flags) {
+  return 0;
+}
+
+/* raw libfuse */
+
+static int raw_getattr(const char *pathname, struct stat *st,
+                       struct fuse_file_info *) {
+  return work_getattr(strlen(pathname), st);
+}
+static int raw_read(const char *, char *buf, size_t count, off_t offset,
+                    struct fuse_file_info *) {
+  return work_read(buf, count, offset);
+}
+static int raw_write(const char *, const char *buf, size_t count, off_t offset,
+                     struct fuse_file_info *) {
+  return work_write(buf, count, offset);
+}
+static int raw_readdir(const char *, void *buf, fuse_fill_dir_t filler, off_t,
+                       struct fuse_file_info *, enum fuse_readdir_flags) {
+  for (size_t idx = 0; idx < entry_count; ++idx) {
+    filler(buf, entry_names[idx], 0, 0, (enum fuse_fill_dir_flags)0);
+  }
+  return 0;
+}
+static int raw_rename(const char *, const char *, unsigned int) { return 0; }
+
+static struct fuse_operations raw_operations() {
+  struct fuse_operations ops;
+  memset(&ops, 0, sizeof(ops));
+  ops.getattr = raw_getattr;
+  ops.read = raw_read;
+  ops.write = raw_write;
+  ops.readdir = raw_readdir;
+  ops.rename = raw_rename;
+  return ops;
+}
+
+/* fuse++ */
+
+class PathBench : public fuse {
+public:
+  int getattr(path_t pathname, struct stat *st,
+              struct fuse_file_info *) override {
+    return work_getattr(pathname.size(), st);
+  }
+  int read(path_t, char *buf, size_t count, off_t offset,
+           struct fuse_file_info *) override {
+    return work_read(buf, count, offset);
+  }
+  int write(path_t, const char *buf, size_t count, off_t offset,
+            struct fuse_file_info *) override {
+    return work_write(buf, count, offset);
+  }
+  int readdir(path_t, off_t, struct fuse_file_info *, readdir_flags) override {
+    for (size_t idx = 0; idx < entry_count; ++idx) {
+      fill_dir(entry_names[idx], 0);
+    }
+    return 0;
+  }
+  int rename(path_t, path_t, unsigned int) override { return 0; }
+};
+
+class StringBench : public fuse {
+public:
+  int getattr(const std::string &pathname, struct stat *st) override {
+    return work_getattr(pathname.size(), st);
+  }
+  int read(const std::string &, char *buf, size_t count, off_t offset,
+           struct fuse_file_info *) override {
+    return work_read(buf, count, offset);
+  }
+  int write(const std::string &, const char *buf, size_t count, off_t offset,
+            struct fuse_file_info *) override {
+    return work_write(buf, count, offset);
+  }
+  int readdir(const std::string &, off_t, struct fuse_file_info *,
+              readdir_flags) override {
+    for (size_t idx = 0; idx < entry_count; ++idx) {
+      fill_dir(entry_names[idx], 0);
+    }
+    return 0;
+  }
+  int rename(const std::string &, const std::string &,
+             unsigned int) override {
+    return 0;
+  }
+};
+
+class HandleBench : public PathBench {
+public:
+  class File : public handle_t {
+  public:
+    int read(char *buf, size_t count, off_t offset,
+             struct fuse_file_info *) override {
+      return work_read(buf, count, offset);
+    }
+    int write(const char *buf, size_t count, off_t offset,
+              struct fuse_file_info *) override {
+      return work_write(buf, count, offset);
+    }
+  };
+  class Dir : public dir_handle_t {
+  public:
+    Dir() : idx(0) {}
+
+  protected:
+    void rewind() override { idx = 0; }
+    int next(std::string &name, struct stat *st, readdir_flags) override {
+      if (idx == entry_count) {
+        return 0;
+      }
+      name = entry_names[idx++];
+      st->st_mode = S_IFREG;
+      return 1;
+    }
+
+  private:
+    size_t idx;
+  };
+
+  int open(path_t, struct fuse_file_info *fi) override {
+    set_handle(fi, new File);
+    return 0;
+  }
+  int opendir(path_t, struct fuse_file_info *fi) override {
+    set_handle(fi, new Dir);
+    return 0;
+  }
+};
+
+/* raw libfuse lowlevel */
+
+static void raw_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                           struct fuse_file_info *) {
+  struct stat st;
+  work_getattr(ino, &st);
+  fuse_reply_attr(req, &st, 1.0);
+}
+static void raw_ll_read(fuse_req_t req, fuse_ino_t, size_t size, off_t off,
+                        struct fuse_file_info *) {
+  fuse_reply_buf(req, data + off, size);
+}
+static void raw_ll_write(fuse_req_t req, fuse_ino_t, const char *buf,
+                         size_t size, off_t off, struct fuse_file_info *) {
+  fuse_reply_write(req, work_write(buf, size, off));
+}
+static void raw_ll_readdir(fuse_req_t req, fuse_ino_t, size_t size, off_t,
+                           struct fuse_file_info *) {
+  char *buf = (char *)malloc(size);
+  size_t used = 0;
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  for (size_t idx = 0; idx < entry_count; ++idx) {
+    used += fuse_add_direntry(req, buf + used, size - used, entry_names[idx],
+                              &st, idx + 1);
+  }
+  fuse_reply_buf(req, buf, used < size ? used : size);
+  free(buf);
+}
+static void raw_ll_rename(fuse_req_t req, fuse_ino_t, const char *, fuse_ino_t,
+                          const char *, unsigned int) {
+  fuse_reply_err(req, 0);
+}
+static void raw_ll_lookup(fuse_req_t req, fuse_ino_t, const char *name) {
+  struct fuse_entry_param e;
+  work_lookup(name, &e);
+  fuse_reply_entry(req, &e);
+}
+static void raw_ll_forget(fuse_req_t req, fuse_ino_t, uint64_t) {
+  fuse_reply_none(req);
+}
+static void raw_ll_forget_multi(fuse_req_t req, size_t,
+                                struct fuse_forget_data *) {
+  fuse_reply_none(req);
+}
+
+static struct fuse_lowlevel_ops raw_ll_operations() {
+  struct fuse_lowlevel_ops ops;
+  memset(&ops, 0, sizeof(ops));
+  ops.getattr = raw_ll_getattr;
+  ops.read = raw_ll_read;
+  ops.write = raw_ll_write;
+  ops.readdir = raw_ll_readdir;
+  ops.rename = raw_ll_rename;
+  ops.lookup = raw_ll_lookup;
+  ops.forget = raw_ll_forget;
+  ops.forget_multi = raw_ll_forget_multi;
+  return ops;
+}
+
+/* fuse++ lowlevel */
+
+class LowlevelBench : public fuse_lowlevel {
+public:
+  // too small for a directory, so the table grows
+  LowlevelBench() : inodes(16) {}
+
+  void getattr(req_t req, uint64_t ino, struct fuse_file_info *) override {
+    struct stat st;
+    work_getattr(ino, &st);
+    req.reply_attr(&st, 1.0);
+  }
+  void read(req_t req, uint64_t, size_t size, off_t off,
+            struct fuse_file_info *) override {
+    req.reply_buf(data + off, size);
+  }
+  void write(req_t req, uint64_t, const char *buf, size_t size, off_t off,
+             struct fuse_file_info *) override {
+    req.reply_write(work_write(buf, size, off));
+  }
+  void readdir(req_t req, uint64_t, size_t size, off_t,
+               struct fuse_file_info *) override {
+    char *buf = (char *)malloc(size);
+    size_t used = 0;
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    for (size_t idx = 0; idx < entry_count; ++idx) {
+      used += req.add_direntry(buf + used, size - used, entry_names[idx], &st,
+                               idx + 1);
+    }
+    req.reply_buf(buf, used < size ? used : size);
+    free(buf);
+  }
+  void rename(req_t req, uint64_t, const char *, uint64_t, const char *,
+              unsigned int) override {
+    req.reply_err(0);
+  }
+  void lookup(req_t req, uint64_t parent, const char *name) override {
+    struct fuse_entry_param e;
+    work_lookup(name, &e);
+    if (!inodes.add(e.ino, parent)) {
+      req.reply_err(ENOMEM);
+      return;
+    }
+    req.reply_entry(&e);
+  }
+  void forget(req_t req, uint64_t ino, unsigned long nlookup) override {
+    inodes.forget(ino, nlookup);
+    req.reply_none();
+  }
+  void forget_multi(req_t req, size_t count,
+                    struct fuse_forget_data *forgets) override {
+    inodes.forget(forgets, count);
+    req.reply_none();
+  }
+
+  // the parent of each inode looked up
+  inode_table<uint64_t> inodes;
+};
+
+/* harness */
+
+// what a thread needs to issue one kind of request
+struct state_t {
+  const struct fuse_operations *ops;
+  const struct fuse_lowlevel_ops *llops;
+  void *fs;
+  std::string path;
+  std::string newpath;
+  size_t bufsize;
+  std::vector<char> buf;
+  struct fuse_file_info fi;
+};
+
+typedef void (*op_t)(state_t &state);
+
+static void hl_getattr(state_t &state) {
+  struct stat st;
+  state.ops->getattr(state.path.c_str(), &st, 0);
+}
+static void hl_read(state_t &state) {
+  struct fuse_bufvec *bufp;
+  if (state.ops->read_buf) {
+    if (state.ops->read_buf(state.path.c_str(), &bufp, state.bufsize, 0,
+                            &state.fi) >= 0) {
+      free(bufp->buf[0].mem);
+      free(bufp);
+    }
+  } else {
+    // what libfuse does without read_buf
+    bufp = (struct fuse_bufvec *)malloc(sizeof(*bufp));
+    bufp->buf[0].mem = malloc(state.bufsize);
+    state.ops->read(state.path.c_str(), (char *)bufp->buf[0].mem,
+                    state.bufsize, 0, &state.fi);
+    free(bufp->buf[0].mem);
+    free(bufp);
+  }
+}
+static void hl_write(state_t &state) {
+  if (state.ops->write_buf) {
+    struct fuse_bufvec bufvec;
+    bufvec.count = 1;
+    bufvec.idx = 0;
+    bufvec.off = 0;
+    bufvec.buf[0].size = state.bufsize;
+    bufvec.buf[0].flags = (enum fuse_buf_flags)0;
+    bufvec.buf[0].mem = &state.buf[0];
+    bufvec.buf[0].fd = -1;
+    bufvec.buf[0].pos = 0;
+    state.ops->write_buf(state.path.c_str(), &bufvec, 0, &state.fi);
+  } else {
+    // what libfuse does without write_buf, for a memory buffer
+    state.ops->write(state.path.c_str(), &state.buf[0], state.bufsize, 0,
+                     &state.fi);
+  }
+}
+static void hl_readdir(state_t &state) {
+  state.ops->readdir(state.path.c_str(), 0, filler, 0, &state.fi,
+                     (enum fuse_readdir_flags)0);
+}
+static void hl_rename(state_t &state) {
+  state.ops->rename(state.path.c_str(), state.newpath.c_str(), 0);
+}
+
+static fuse_req_t bench_req(state_t &state) { return (fuse_req_t)&state; }
+
+static void ll_getattr(state_t &state) {
+  state.llops->getattr(bench_req(state), 2, 0);
+}
+static void ll_read(state_t &state) {
+  state.llops->read(bench_req(state), 2, state.bufsize, 0, &state.fi);
+}
+static void ll_write(state_t &state) {
+  state.llops->write(bench_req(state), 2, &state.buf[0], state.bufsize, 0,
+                     &state.fi);
+}
+static void ll_readdir(state_t &state) {
+  state.llops->readdir(bench_req(state), 1, 4096, 0, &state.fi);
+}
+static void ll_rename(state_t &state) {
+  // names only, at most NAME_MAX
+  state.llops->rename(bench_req(state), 1, state.path.c_str(), 1,
+                      state.newpath.c_str(), 0);
+}
+static void ll_forget(state_t &state) {
+  // the even entries looked up twice and forgotten in a batch, the way
+  // the kernel drops them, and the odd ones forgotten one at a time
+  struct fuse_forget_data forgets[entry_count / 2];
+  for (size_t idx = 0; idx < entry_count; ++idx) {
+    state.llops->lookup(bench_req(state), 1, entry_names[idx]);
+    if (idx % 2 == 0) {
+      state.llops->lookup(bench_req(state), 1, entry_names[idx]);
+      forgets[idx / 2].ino = entry_inos[idx];
+      forgets[idx / 2].nlookup = 2;
+    }
+  }
+  for (size_t idx = 1; idx < entry_count; idx += 2) {
+    state.llops->forget(bench_req(state), entry_inos[idx], 1);
+  }
+  state.llops->forget_multi(bench_req(state), entry_count / 2, forgets);
+}
+
+// a path of exactly 'size' characters, ending in 'last'
+static std::string make_path(size_t size, char last) {
+  std::string path = "/";
+  while (path.size() + 8 < size) {
+    path += "abcdefg/";
+  }
+  path.resize(size - 1, 'f');
+  return path + last;
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+struct run_t {
+  state_t state;
+  op_t op;
+  bool dir;
+  size_t iterations;
+  pthread_barrier_t *barrier;
+  double start;
+  double end;
+  size_t allocations;
+};
+
+static void *thread_main(void *arg) {
+  run_t &run = *static_cast<run_t *>(arg);
+  state_t &state = run.state;
+  bench_context.private_data = state.fs;
+  bench_userdata = state.fs;
+  memset(&state.fi, 0, sizeof(state.fi));
+  if (state.ops) {
+    if (run.dir && state.ops->opendir) {
+      state.ops->opendir(state.path.c_str(), &state.fi);
+    } else if (!run.dir && state.ops->open) {
+      state.ops->open(state.path.c_str(), &state.fi);
+    }
+  }
+
+  for (size_t idx = 0; idx < run.iterations / 8; ++idx) {
+    run.op(state);
+  }
+  pthread_barrier_wait(run.barrier);
+  size_t before = allocations;
+  run.start = now();
+  for (size_t idx = 0; idx < run.iterations; ++idx) {
+    run.op(state);
+  }
+  run.end = now();
+  run.allocations = allocations - before;
+
+  if (state.ops) {
+    if (run.dir && state.ops->releasedir) {
+      state.ops->releasedir(state.path.c_str(), &state.fi);
+    } else if (!run.dir && state.ops->release) {
+      state.ops->release(state.path.c_str(), &state.fi);
+    }
+  }
+  return 0;
+}
+
+struct variant_t {
+  const char *name;
+  const struct fuse_operations *ops;
+  const struct fuse_lowlevel_ops *llops;
+  void *fs;
+  bool populate; // each thread needs a file of its own, created first
+};
+
+struct case_t {
+  const char *name;
+  op_t op;
+  op_t llop;
+  bool dir;
+  bool handle; // worth running the handle variant
+  bool paths;  // varies with the path length
+  bool bufs;   // varies with the buffer size
+  size_t divisor; // of the iterations, for the costlier operations
+  bool tree;      // runs on memfs
+  // at most, per high-level then lowlevel operation; -1 not checked
+  int allocs[2];
+};
+
+// the path of a thread's own file, the same length as 'path'
+static std::string own_path(const std::string &path, size_t thread) {
+  char digits[24];
+  int size = snprintf(digits, sizeof(digits), "%zu", thread);
+  return path.substr(0, path.size() - size) + digits;
+}
+
+// create a file with its directories, and fill its directory
+static void populate(const variant_t &variant, const std::string &path) {
+  const struct fuse_operations *ops = variant.ops;
+  struct fuse_file_info fi;
+  bench_context.private_data = variant.fs;
+  for (size_t idx = path.find('/', 1); idx != std::string::npos;
+       idx = path.find('/', idx + 1)) {
+    ops->mkdir(path.substr(0, idx).c_str(), 0755);
+  }
+  std::string dir = path.substr(0, path.rfind('/') + 1);
+  for (size_t idx = 0; idx < entry_count; ++idx) {
+    std::string entry = dir + entry_names[idx];
+    memset(&fi, 0, sizeof(fi));
+    if (ops->create(entry.c_str(), 0644, &fi) == 0) {
+      ops->release(entry.c_str(), &fi);
+    }
+  }
+  memset(&fi, 0, sizeof(fi));
+  fi.flags = O_WRONLY;
+  if (ops->create(path.c_str(), 0644, &fi) == 0) {
+    ops->write(path.c_str(), data, 131072, 0, &fi);
+    ops->release(path.c_str(), &fi);
+  }
+}
+
+// the allocations per operation, or -1 if not counted
+static double measure(const case_t &bench, const variant_t &variant,
+                      size_t pathlen, size_t bufsize, size_t threads,
+                      size_t iterations) {
+  op_t op = variant.llops ? bench.llop : bench.op;
+  if (!op || (variant.llops && pathlen > 255)) {
+    // lowlevel operations see names, not paths
+    return -1;
+  }
+  pthread_barrier_t barrier;
+  pthread_barrier_init(&barrier, 0, threads);
+  std::vector<run_t> runs(threads);
+  std::vector<pthread_t> ids(threads);
+  for (size_t idx = 0; idx < threads; ++idx) {
+    run_t &run = runs[idx];
+    run.state.ops = variant.ops;
+    run.state.llops = variant.llops;
+    run.state.fs = variant.fs;
+    run.state.path = make_path(pathlen, 'f');
+    run.state.newpath = make_path(pathlen, 'g');
+    if (variant.populate) {
+      run.state.path = own_path(run.state.path, idx);
+      populate(variant, run.state.path);
+      if (bench.dir) {
+        size_t slash = run.state.path.rfind('/');
+        run.state.path = slash ? run.state.path.substr(0, slash) : "/";
+      }
+    }
+    if (variant.llops) {
+      run.state.path = run.state.path.substr(run.state.path.rfind('/') + 1);
+      run.state.newpath =
+          run.state.newpath.substr(run.state.newpath.rfind('/') + 1);
+    }
+    run.state.bufsize = bufsize;
+    run.state.buf.assign(bufsize, 'x');
+    run.op = op;
+    run.dir = bench.dir;
+    run.iterations = iterations;
+    run.barrier = &barrier;
+    pthread_create(&ids[idx], 0, thread_main, &run);
+  }
+  // from the first thread starting to the last one finishing
+  double start = 0;
+  double end = 0;
+  size_t allocated = 0;
+  for (size_t idx = 0; idx < threads; ++idx) {
+    pthread_join(ids[idx], 0);
+    allocated += runs[idx].allocations;
+    if (idx == 0 || runs[idx].start < start) {
+      start = runs[idx].start;
+    }
+    if (idx == 0 || runs[idx].end > end) {
+      end = runs[idx].end;
+    }
+  }
+  pthread_barrier_destroy(&barrier);
+  double elapsed = end - start;
+
+  char path[16] = "-";
+  char buf[16] = "-";
+  if (bench.paths) {
+    snprintf(path, sizeof(path), "%zu", pathlen);
+  }
+  if (bench.bufs) {
+    snprintf(buf, sizeof(buf), "%zu", bufsize);
+  }
+  double per_op = -1;
+  char allocs[16] = "-";
+#ifdef COUNTING_ALLOCATIONS
+  per_op = (double)allocated / (threads * iterations);
+  snprintf(allocs, sizeof(allocs), "%.2f", per_op);
+#endif
+  printf("%-8s %-9s %6s %7s %7zu %10.1f %10.2f %7s\n", bench.name,
+         variant.name, path, buf, threads, elapsed / iterations,
+         threads * iterations / elapsed * 1e3, allocs);
+  return per_op;
+}
+
+// for --check: whether a measurement allocated no more than expected
+static bool expected(const case_t &bench, const variant_t &variant,
+                     double allocs) {
+  int most = bench.allocs[variant.llops ? 1 : 0];
+  if (most >= 0 && allocs > most) {
+    printf("^ expected at most %d allocations per operation\n", most);
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  bool check = argc > 1 && strcmp(argv[1], "--check") == 0;
+  if (check) {
+    --argc;
+    ++argv;
+  }
+#ifndef COUNTING_ALLOCATIONS
+  if (check) {
+    printf("allocations are only counted with glibc\n");
+    return 77;
+  }
+#endif
+  size_t iterations = argc > 1 ? strtoul(argv[1], 0, 0) : 100000;
+  size_t max_threads = argc > 2 ? strtoul(argv[2], 0, 0) : 8;
+
+  for (size_t idx = 0; idx < entry_count; ++idx) {
+    snprintf(entry_names[idx], sizeof(entry_names[idx]), "entry-%03zu", idx);
+    struct fuse_entry_param e;
+    work_lookup(entry_names[idx], &e);
+    entry_inos[idx] = e.ino;
+  }
+  memset(data, 'x', sizeof(data));
+  bench_ctx.umask = 022;
+
+  struct fuse_operations raw = raw_operations();
+  struct fuse_lowlevel_ops raw_ll = raw_ll_operations();
+  PathBench path_fs;
+  StringBench string_fs;
+  HandleBench handle_fs;
+  LowlevelBench lowlevel_fs;
+  memfs memfs_fs;
+  const variant_t variants[] = {
+      {"raw", &raw, 0, 0, false},
+      {"path_t", &fuse::operations(), 0, &path_fs, false},
+      {"string", &fuse::operations(), 0, &string_fs, false},
+      {"handle", &fuse::operations(), 0, &handle_fs, false},
+      {"raw_ll", 0, &raw_ll, 0, false},
+      {"lowlevel", 0, &fuse_lowlevel::operations(), &lowlevel_fs, false},
+      {"memfs", &fuse::operations(), 0, &memfs_fs, true},
+  };
+  const case_t cases[] = {
+      {"getattr", hl_getattr, ll_getattr, false, false, true, false, 1, true,
+       {0, 0}},
+      // the lowlevel read replies from its own buffer
+      {"read", hl_read, ll_read, false, true, false, true, 1, true, {2, 0}},
+      {"write", hl_write, ll_write, false, true, false, true, 1, true,
+       {0, 0}},
+      {"readdir", hl_readdir, ll_readdir, true, true, true, false, 16, true,
+       {-1, -1}},
+      {"rename", hl_rename, ll_rename, false, false, true, false, 1, false,
+       {-1, -1}},
+      {"forget", 0, ll_forget, false, false, false, false, 16, false,
+       {-1, 1}},
+  };
+  const size_t pathlens[] = {8, 64, 512, 4096};
+  const size_t bufsizes[] = {4096, 65536, 131072};
+  bool passed = true;
+
+  printf("%-8s %-9s %6s %7s %7s %10s %10s %7s\n", "op", "variant", "path",
+         "buf", "threads", "ns/op", "Mops/s", "allocs");
+  for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c) {
+    const case_t &bench = cases[c];
+    if (check && bench.allocs[0] < 0 && bench.allocs[1] < 0) {
+      continue;
+    }
+    for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); ++v) {
+      const variant_t &variant = variants[v];
+      if (!bench.handle && variant.fs == &handle_fs) {
+        continue;
+      }
+      if (variant.populate && !bench.tree) {
+        continue;
+      }
+      for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        if (bench.bufs) {
+          for (size_t b = 0; b < sizeof(bufsizes) / sizeof(bufsizes[0]);
+               ++b) {
+            size_t scaled = iterations * bufsizes[0] / bufsizes[b];
+            double allocs = measure(bench, variant, 64, bufsizes[b], threads,
+                                    scaled ? scaled : 1);
+            if (check && !expected(bench, variant, allocs)) {
+              passed = false;
+            }
+          }
+        } else if (bench.paths) {
+          for (size_t p = 0; p < sizeof(pathlens) / sizeof(pathlens[0]);
+               ++p) {
+            size_t scaled = iterations / bench.divisor;
+            double allocs = measure(bench, variant, pathlens[p], 4096,
+                                    threads, scaled ? scaled : 1);
+            if (check && !expected(bench, variant, allocs)) {
+              passed = false;
+            }
+          }
+        } else {
+          size_t scaled = iterations / bench.divisor;
+          double allocs = measure(bench, variant, 64, 4096, threads,
+                                  scaled ? scaled : 1);
+          if (check && !expected(bench, variant, allocs)) {
+            passed = false;
+          }
+        }
+      }
+    }
+  }
+  if (check && lowlevel_fs.inodes.size() != 0) {
+    printf("%zu inodes left in the table\n", lowlevel_fs.inodes.size());
+    passed = false;
+  }
+  return passed ? 0 : 1;
+}
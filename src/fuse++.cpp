@@ -1,7 +1,17 @@
 #include <fuse++>
 
+#include <algorithm>
 #include <cerrno>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <vector>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
 
 #if defined(_WIN32) || defined(_WIN64)
 #define thread_local _declspec(thread)
@@ -16,138 +26,1624 @@
 #endif
 
 #include <fuse.h>
+#if FUSE_VERSION >= 30
+#include <fuse_lowlevel.h>
+#endif
+
+/* the attribute cache, see config_t::cache_attr_timeout */
+
+class fuse::attr_cache {
+public:
+  enum {
+    // the parent directory's attributes changed too
+    PARENT = 1 << 0,
+    // and everything under the path may have
+    TREE = 1 << 1,
+  };
+
+  attr_cache() : generation(0) {
+    for (size_t i = 0; i < shard_count; ++i) {
+      pthread_mutex_init(&shards[i].lock, 0);
+      memset(&shards[i].stats, 0, sizeof(shards[i].stats));
+    }
+  }
+  ~attr_cache() {
+    for (size_t i = 0; i < shard_count; ++i) {
+      clear(shards[i]);
+      pthread_mutex_destroy(&shards[i].lock);
+    }
+  }
+
+  // the cached result of getattr, if there is one
+  bool get(path_t pathname, struct stat *buf, int &result) {
+    shard_t &shard = shard_of(pathname);
+    uint64_t now = clock();
+    pthread_mutex_lock(&shard.lock);
+    entries_t::iterator it = shard.entries.find(pathname);
+    bool hit = it != shard.entries.end() && it->second->expires > now;
+    if (hit) {
+      result = it->second->result;
+      if (result == 0) {
+        *buf = it->second->attr;
+        ++shard.stats.hits;
+      } else {
+        ++shard.stats.negative_hits;
+      }
+    } else {
+      ++shard.stats.misses;
+    }
+    pthread_mutex_unlock(&shard.lock);
+    return hit;
+  }
+
+  // for put(), taken before calling getattr
+  uint64_t current() const {
+    return __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+  }
+
+  // cache the result of getattr, unless anything changed since 'since'
+  void put(const config_t &config, path_t pathname, const struct stat *buf,
+           int result, uint64_t since) {
+    double timeout = result == 0         ? config.cache_attr_timeout
+                     : result == -ENOENT ? config.cache_negative_timeout
+                                         : 0;
+    if (timeout <= 0) {
+      return;
+    }
+    size_t limit = config.cache_size ? config.cache_size : 65536;
+    limit = (limit + shard_count - 1) / shard_count;
+    uint64_t expires = clock() + (uint64_t)(timeout * 1e9);
+
+    shard_t &shard = shard_of(pathname);
+    pthread_mutex_lock(&shard.lock);
+    if (current() == since) {
+      entries_t::iterator it = shard.entries.find(pathname);
+      if (it == shard.entries.end()) {
+        if (shard.entries.size() >= limit) {
+          evict(shard);
+        }
+        entry_t *entry = new entry_t(pathname);
+        it = shard.entries.insert(std::make_pair(path_t(entry->path), entry))
+                 .first;
+      }
+      if (result == 0) {
+        it->second->attr = *buf;
+      }
+      it->second->result = result;
+      it->second->expires = expires;
+    }
+    pthread_mutex_unlock(&shard.lock);
+  }
+
+  // after an operation that may have changed a path, NULL for any
+  void changed(const char *pathname, int what) {
+    __atomic_add_fetch(&generation, 1, __ATOMIC_ACQ_REL);
+    if (!pathname) {
+      clear();
+      return;
+    }
+    path_t path(pathname);
+    erase(path, what & TREE);
+    if (what & PARENT) {
+      erase(path.parent(), false);
+    }
+  }
+
+  void erase(path_t pathname, bool tree) {
+    shard_t &shard = shard_of(pathname);
+    pthread_mutex_lock(&shard.lock);
+    entries_t::iterator it = shard.entries.find(pathname);
+    if (it != shard.entries.end()) {
+      delete it->second;
+      shard.entries.erase(it);
+      ++shard.stats.invalidations;
+    }
+    pthread_mutex_unlock(&shard.lock);
+    if (!tree) {
+      return;
+    }
+
+    // everything under it sorts just after pathname + "/"
+    std::string prefix = pathname.str();
+    if (prefix.empty() || prefix[prefix.size() - 1] != '/') {
+      prefix += '/';
+    }
+    path_t under(prefix);
+    for (size_t i = 0; i < shard_count; ++i) {
+      pthread_mutex_lock(&shards[i].lock);
+      entries_t &entries = shards[i].entries;
+      entries_t::iterator it = entries.lower_bound(under);
+      while (it != entries.end() && it->first.size() >= under.size() &&
+             memcmp(it->first.data(), under.data(), under.size()) == 0) {
+        delete it->second;
+        entries.erase(it++);
+        ++shards[i].stats.invalidations;
+      }
+      pthread_mutex_unlock(&shards[i].lock);
+    }
+  }
+
+  void clear() {
+    for (size_t i = 0; i < shard_count; ++i) {
+      pthread_mutex_lock(&shards[i].lock);
+      shards[i].stats.invalidations += shards[i].entries.size();
+      clear(shards[i]);
+      pthread_mutex_unlock(&shards[i].lock);
+    }
+  }
+
+  void stats(cache_stats_t &stats) {
+    memset(&stats, 0, sizeof(stats));
+    for (size_t i = 0; i < shard_count; ++i) {
+      pthread_mutex_lock(&shards[i].lock);
+      stats.hits += shards[i].stats.hits;
+      stats.negative_hits += shards[i].stats.negative_hits;
+      stats.misses += shards[i].stats.misses;
+      stats.invalidations += shards[i].stats.invalidations;
+      pthread_mutex_unlock(&shards[i].lock);
+    }
+  }
+
+private:
+  struct entry_t {
+    entry_t(path_t pathname) : path(pathname.str()) {}
+
+    std::string path;
+    struct stat attr;
+    // 0 or -ENOENT
+    int result;
+    // in clock() nanoseconds
+    uint64_t expires;
+  };
+
+  // keys viewing entry_t::path
+  typedef std::map<path_t, entry_t *> entries_t;
+
+  struct shard_t {
+    pthread_mutex_t lock;
+    entries_t entries;
+    cache_stats_t stats;
+  };
+
+  static const size_t shard_count = 16;
+
+  static uint64_t clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  }
+
+  shard_t &shard_of(path_t pathname) {
+    return shards[pathname.hash() % shard_count];
+  }
+
+  static void clear(shard_t &shard) {
+    for (entries_t::iterator it = shard.entries.begin();
+         it != shard.entries.end(); ++it) {
+      delete it->second;
+    }
+    shard.entries.clear();
+  }
+
+  // make room in a full shard: drop what expired, or everything if
+  // that is under a quarter, so a scan is only needed every so often
+  static void evict(shard_t &shard) {
+    uint64_t now = clock();
+    size_t size = shard.entries.size();
+    for (entries_t::iterator it = shard.entries.begin();
+         it != shard.entries.end();) {
+      if (it->second->expires <= now) {
+        delete it->second;
+        shard.entries.erase(it++);
+      } else {
+        ++it;
+      }
+    }
+    if (shard.entries.size() > size - size / 4) {
+      clear(shard);
+    }
+  }
+
+  shard_t shards[shard_count];
+  // bumped by every change, changed atomically
+  uint64_t generation;
+};
+
+/* the read cache, see config_t::read_cache_size */
+
+class fuse::read_cache {
+public:
+  read_cache()
+      : total(0), victim(0), generation(0), started(false), stopping(false),
+        busy(0) {
+    for (size_t i = 0; i < shard_count; ++i) {
+      pthread_mutex_init(&shards[i].lock, 0);
+      shards[i].hand = 0;
+      memset(&shards[i].stats, 0, sizeof(shards[i].stats));
+    }
+    pthread_mutex_init(&files_lock, 0);
+    pthread_mutex_init(&lock, 0);
+    pthread_cond_init(&queued, 0);
+    pthread_cond_init(&idle, 0);
+  }
+  ~read_cache() {
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_signal(&queued);
+    pthread_mutex_unlock(&lock);
+    if (started) {
+      pthread_join(thread, 0);
+    }
+    pthread_cond_destroy(&idle);
+    pthread_cond_destroy(&queued);
+    pthread_mutex_destroy(&lock);
+    for (size_t i = 0; i < shard_count; ++i) {
+      clear(shards[i]);
+      pthread_mutex_destroy(&shards[i].lock);
+    }
+    pthread_mutex_destroy(&files_lock);
+  }
+
+  // copy up to 'count' bytes from 'skip' on in a cached block, setting
+  // 'size' to the size of the block, short at the end of the file
+  bool get(path_t pathname, uint64_t index, size_t skip, char *buf,
+           size_t count, size_t &size) {
+    shard_t &shard = shard_of(pathname, index);
+    pthread_mutex_lock(&shard.lock);
+    blocks_t::iterator it = shard.blocks.find(block_id_t(pathname, index));
+    bool hit = it != shard.blocks.end();
+    if (hit) {
+      block_t &block = *it->second;
+      block.referenced = true;
+      size = block.data.size();
+      if (skip < size) {
+        memcpy(buf, block.data.data() + skip, std::min(count, size - skip));
+      }
+      ++shard.stats.hits;
+    } else {
+      ++shard.stats.misses;
+    }
+    pthread_mutex_unlock(&shard.lock);
+    return hit;
+  }
+
+  bool contains(path_t pathname, uint64_t index) {
+    shard_t &shard = shard_of(pathname, index);
+    pthread_mutex_lock(&shard.lock);
+    bool found = shard.blocks.count(block_id_t(pathname, index)) != 0;
+    pthread_mutex_unlock(&shard.lock);
+    return found;
+  }
+
+  // for put(), taken before reading the block
+  uint64_t current() const {
+    return __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+  }
+
+  // cache a block, unless anything changed since 'since'
+  //
+  // The size and the file limit are counted over all the shards, in
+  // whole blocks rounded down: a full cache makes room in whichever
+  // shard has a block to give.
+  void put(const config_t &config, path_t pathname, uint64_t index,
+           const char *data, size_t size, uint64_t since, bool ahead) {
+    size_t block_size = config.read_cache_block;
+    size_t capacity = config.read_cache_size / block_size;
+    size_t limit = config.read_cache_file_limit
+                       ? config.read_cache_file_limit / block_size
+                       : ~(size_t)0;
+    if (!reserve(capacity) && !evict_any()) {
+      return;
+    }
+
+    // the place reserved, or evicted, is given back if not taken
+    shard_t &shard = shard_of(pathname, index);
+    pthread_mutex_lock(&shard.lock);
+    if (current() != since ||
+        shard.blocks.count(block_id_t(pathname, index)) ||
+        !admit(pathname, limit)) {
+      pthread_mutex_unlock(&shard.lock);
+      __atomic_sub_fetch(&total, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    size_t slot;
+    if (shard.free.empty()) {
+      slot = shard.ring.size();
+      shard.ring.push_back(0);
+    } else {
+      slot = shard.free.back();
+      shard.free.pop_back();
+    }
+    files_t::iterator file = shard.files.find(pathname);
+    if (file == shard.files.end()) {
+      file_t *created = new file_t(pathname);
+      file =
+          shard.files.insert(std::make_pair(path_t(created->path), created))
+              .first;
+    }
+    block_t *block = new block_t;
+    block->file = file->second;
+    block->index = index;
+    block->data.assign(data, size);
+    block->referenced = false;
+    block->slot = slot;
+    shard.ring[slot] = block;
+    shard.blocks.insert(
+        std::make_pair(block_id_t(path_t(block->file->path), index), block));
+    ++block->file->blocks;
+    if (ahead) {
+      ++shard.stats.readahead;
+    }
+    pthread_mutex_unlock(&shard.lock);
+  }
+
+  // after an operation that may have changed a path, NULL for any
+  void changed(const char *pathname, bool tree) {
+    __atomic_add_fetch(&generation, 1, __ATOMIC_ACQ_REL);
+    if (!pathname) {
+      for (size_t i = 0; i < shard_count; ++i) {
+        pthread_mutex_lock(&shards[i].lock);
+        __atomic_sub_fetch(&total, shards[i].blocks.size(), __ATOMIC_RELAXED);
+        clear(shards[i]);
+        pthread_mutex_unlock(&shards[i].lock);
+      }
+      return;
+    }
+    path_t path(pathname);
+    // everything under it sorts just after pathname + "/"
+    std::string prefix = path.str();
+    if (prefix.empty() || prefix[prefix.size() - 1] != '/') {
+      prefix += '/';
+    }
+    path_t under(prefix);
+    for (size_t i = 0; i < shard_count; ++i) {
+      shard_t &shard = shards[i];
+      pthread_mutex_lock(&shard.lock);
+      files_t::iterator it = shard.files.find(path);
+      if (it != shard.files.end()) {
+        erase(*this, shard, it);
+      }
+      if (tree) {
+        it = shard.files.lower_bound(under);
+        while (it != shard.files.end() && it->first.size() >= under.size() &&
+               memcmp(it->first.data(), under.data(), under.size()) == 0) {
+          erase(*this, shard, it++);
+        }
+      }
+      pthread_mutex_unlock(&shard.lock);
+    }
+  }
+
+  void stats(read_cache_stats_t &stats) {
+    memset(&stats, 0, sizeof(stats));
+    for (size_t i = 0; i < shard_count; ++i) {
+      pthread_mutex_lock(&shards[i].lock);
+      stats.hits += shards[i].stats.hits;
+      stats.misses += shards[i].stats.misses;
+      stats.readahead += shards[i].stats.readahead;
+      stats.evictions += shards[i].stats.evictions;
+      pthread_mutex_unlock(&shards[i].lock);
+    }
+  }
+
+  /* readahead */
+
+  // after a read through an open file, 'record' standing for it
+  void read_ahead(class fuse &fs, path_t pathname, void *record,
+            const struct fuse_file_info *fi, off_t offset, size_t count) {
+    const config_t &config = fs.config;
+    if (!config.read_cache_readahead) {
+      return;
+    }
+    off_t block_size = config.read_cache_block;
+    pthread_mutex_lock(&lock);
+    stream_t &stream = streams[record];
+    // reads of what was read ahead are sequential too
+    if (stream.run && offset >= stream.next && offset <= stream.ahead) {
+      ++stream.run;
+    } else {
+      stream.run = 1;
+      stream.ahead = offset;
+    }
+    stream.next = offset + count;
+    if (stream.ahead < stream.next) {
+      stream.ahead = stream.next;
+    }
+
+    if (stream.run >= 2 && !stopping) {
+      off_t end = stream.next + block_size * config.read_cache_readahead;
+      while (stream.ahead < end && jobs.size() < max_jobs) {
+        uint64_t index = stream.ahead / block_size;
+        if (!contains(pathname, index)) {
+          job_t job;
+          job.fs = &fs;
+          job.path = pathname.str();
+          job.record = record;
+          job.fi = *fi;
+          job.index = index;
+          jobs.push_back(job);
+          if (!started) {
+            started = pthread_create(&thread, 0, work, this) == 0;
+          }
+          pthread_cond_signal(&queued);
+        }
+        stream.ahead = (index + 1) * block_size;
+      }
+    }
+    pthread_mutex_unlock(&lock);
+  }
+
+  // before an open file is released, so it is not read any more
+  void closing(void *record) {
+    pthread_mutex_lock(&lock);
+    streams.erase(record);
+    for (std::deque<job_t>::iterator it = jobs.begin(); it != jobs.end();) {
+      if (it->record == record) {
+        it = jobs.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    while (busy == record) {
+      pthread_cond_wait(&idle, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+  }
+
+private:
+  struct file_t {
+    file_t(path_t pathname) : path(pathname.str()), blocks(0) {}
+
+    std::string path;
+    // in the shard, or in all of them for read_cache::files
+    size_t blocks;
+  };
+
+  struct block_t {
+    file_t *file;
+    uint64_t index;
+    std::string data;
+    // since the clock hand last passed
+    bool referenced;
+    // in shard_t::ring
+    size_t slot;
+  };
+
+  struct block_id_t {
+    block_id_t(path_t path, uint64_t index) : path(path), index(index) {}
+
+    bool operator<(const block_id_t &other) const {
+      int result = path.compare(other.path);
+      return result < 0 || (result == 0 && index < other.index);
+    }
+
+    path_t path;
+    uint64_t index;
+  };
+
+  // keys viewing file_t::path
+  typedef std::map<path_t, file_t *> files_t;
+  typedef std::map<block_id_t, block_t *> blocks_t;
+
+  struct shard_t {
+    pthread_mutex_t lock;
+    files_t files;
+    blocks_t blocks;
+    // the blocks in the order the clock hand passes them, NULL for a
+    // free slot, the free slots also being in 'free'
+    std::vector<block_t *> ring;
+    std::vector<size_t> free;
+    size_t hand;
+    read_cache_stats_t stats;
+  };
+
+  // reads of the same file are spread over all the shards
+  static const size_t shard_count = 16;
+
+  struct stream_t {
+    // where the next sequential read would start
+    off_t next;
+    // read ahead or queued up to here
+    off_t ahead;
+    // the number of sequential reads in a row
+    unsigned run;
+  };
+
+  struct job_t {
+    class fuse *fs;
+    std::string path;
+    void *record;
+    struct fuse_file_info fi;
+    uint64_t index;
+  };
+
+  // the most blocks waiting to be read ahead
+  static const size_t max_jobs = 256;
+
+  shard_t &shard_of(path_t pathname, uint64_t index) {
+    size_t hash = pathname.hash() + index * 0x9e3779b97f4a7c15ULL;
+    return shards[(hash >> 8) % shard_count];
+  }
+
+  // take a place in 'total', unless 'capacity' are taken
+  bool reserve(size_t capacity) {
+    size_t used = __atomic_load_n(&total, __ATOMIC_RELAXED);
+    while (used < capacity) {
+      if (__atomic_compare_exchange_n(&total, &used, used + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // evict a block of any shard, its place in 'total' going to the
+  // caller; false if the cache holds none
+  bool evict_any() {
+    size_t start = __atomic_fetch_add(&victim, 1, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < shard_count; ++i) {
+      shard_t &shard = shards[(start + i) % shard_count];
+      pthread_mutex_lock(&shard.lock);
+      bool found = !shard.blocks.empty();
+      if (found) {
+        evict(*this, shard);
+      }
+      pthread_mutex_unlock(&shard.lock);
+      if (found) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // count a block of a file in 'files', unless it has 'limit' already;
+  // with the shard of the block locked
+  bool admit(path_t pathname, size_t limit) {
+    pthread_mutex_lock(&files_lock);
+    files_t::iterator it = files.find(pathname);
+    bool admitted = it == files.end() ? limit > 0 : it->second->blocks < limit;
+    if (admitted) {
+      if (it == files.end()) {
+        file_t *created = new file_t(pathname);
+        it = files.insert(std::make_pair(path_t(created->path), created))
+                 .first;
+      }
+      ++it->second->blocks;
+    }
+    pthread_mutex_unlock(&files_lock);
+    return admitted;
+  }
+
+  // a block of a file left the cache, with its shard locked
+  void discharge(path_t pathname) {
+    pthread_mutex_lock(&files_lock);
+    files_t::iterator it = files.find(pathname);
+    if (--it->second->blocks == 0) {
+      file_t *file = it->second;
+      files.erase(it);
+      delete file;
+    }
+    pthread_mutex_unlock(&files_lock);
+  }
+
+  // drop a block, leaving its place in 'total' to the caller
+  static void remove(read_cache &cache, shard_t &shard,
+                     blocks_t::iterator it) {
+    block_t *block = it->second;
+    shard.ring[block->slot] = 0;
+    shard.free.push_back(block->slot);
+    shard.blocks.erase(it);
+    file_t *file = block->file;
+    cache.discharge(path_t(file->path));
+    if (--file->blocks == 0) {
+      shard.files.erase(path_t(file->path));
+      delete file;
+    }
+    delete block;
+  }
+
+  // drop the blocks of a file
+  static void erase(read_cache &cache, shard_t &shard,
+                    files_t::iterator file) {
+    path_t path = file->first;
+    blocks_t::iterator it = shard.blocks.lower_bound(block_id_t(path, 0));
+    // the last one takes the file
+    size_t count = file->second->blocks;
+    __atomic_sub_fetch(&cache.total, count, __ATOMIC_RELAXED);
+    while (count--) {
+      remove(cache, shard, it++);
+    }
+  }
+
+  // drop every block, leaving their places in 'total' to the caller
+  void clear(shard_t &shard) {
+    for (blocks_t::iterator it = shard.blocks.begin();
+         it != shard.blocks.end(); ++it) {
+      discharge(path_t(it->second->file->path));
+      delete it->second;
+    }
+    for (files_t::iterator it = shard.files.begin(); it != shard.files.end();
+         ++it) {
+      delete it->second;
+    }
+    shard.blocks.clear();
+    shard.files.clear();
+    shard.ring.clear();
+    shard.free.clear();
+    shard.hand = 0;
+  }
+
+  // drop the first block the clock hand finds not referenced since it
+  // last passed, of a shard holding any
+  static void evict(read_cache &cache, shard_t &shard) {
+    for (;;) {
+      block_t *block = shard.ring[shard.hand];
+      shard.hand = (shard.hand + 1) % shard.ring.size();
+      if (!block) {
+        continue;
+      }
+      if (block->referenced) {
+        block->referenced = false;
+        continue;
+      }
+      remove(cache, shard,
+             shard.blocks.find(
+                 block_id_t(path_t(block->file->path), block->index)));
+      ++shard.stats.evictions;
+      return;
+    }
+  }
+
+  static void *work(void *arg);
+
+  shard_t shards[shard_count];
+  // blocks cached, or about to be, changed atomically
+  size_t total;
+  // where evict_any() starts looking, changed atomically
+  size_t victim;
+  pthread_mutex_t files_lock;
+  // blocks cached of each file, for config_t::read_cache_file_limit
+  files_t files;
+  // bumped by every change, changed atomically
+  uint64_t generation;
+
+  pthread_mutex_t lock;
+  // signalled when there are jobs, or when stopping
+  pthread_cond_t queued;
+  // signalled when the thread is done with a job
+  pthread_cond_t idle;
+  pthread_t thread;
+  bool started;
+  bool stopping;
+  std::map<void *, stream_t> streams;
+  std::deque<job_t> jobs;
+  // the open file being read ahead
+  void *busy;
+};
 
 class fuse::detail {
 public:
+  static thread_local context_t request_context;
+
   static class fuse &fuse() {
     struct fuse_context *ctx = fuse_get_context();
-    class fuse *fuseptr = static_cast<class fuse *>(ctx->private_data);
-    if (fuseptr->pid == 0) {
-      fuseptr->uid = ctx->uid;
-      fuseptr->gid = ctx->gid;
-      fuseptr->pid = ctx->pid;
+    request_context.uid = ctx->uid;
+    request_context.gid = ctx->gid;
+    request_context.pid = ctx->pid;
 #if FUSE_VERSION >= 28
-      fuseptr->umask = ctx->umask;
+    request_context.umask = ctx->umask;
+#else
+    request_context.umask = 022;
 #endif
+    return *static_cast<class fuse *>(ctx->private_data);
+  }
+
+  // operations on open files get a NULL path with nullpath_ok or nopath
+  static path_t view(const char *pathname) {
+    return pathname ? path_t(pathname) : path_t();
+  }
+
+  // Memory of a thread for what an operation needs only until it
+  // returns: scratch() and the copies made by string.  It is released
+  // back to a mark, in stack order, and kept for the next operation.
+  class arena {
+  public:
+    struct mark_t {
+      size_t chunk;
+      size_t used;
+      size_t strings;
+    };
+
+    // open frames; scratch() needs one
+    unsigned depth;
+
+    static arena &get() {
+      if (!thread_arena) {
+        pthread_once(&arena_once, create_arena_key);
+        thread_arena = new arena;
+        pthread_setspecific(arena_key, thread_arena);
+      }
+      return *thread_arena;
+    }
+
+    mark_t mark() const {
+      mark_t mark = {chunk, used, strings_used};
+      return mark;
+    }
+    void release(const mark_t &mark) {
+      chunk = mark.chunk;
+      used = mark.used;
+      strings_used = mark.strings;
+    }
+
+    void *allocate(size_t size) {
+      if (size > SIZE_MAX - alignment) {
+        return 0;
+      }
+      size = (size + alignment - 1) & ~(alignment - 1);
+      if (chunk < chunks.size() && chunks[chunk].size - used >= size) {
+        used += size;
+        return chunks[chunk].data + used - size;
+      }
+      // the chunks after this one are unused, and so is this one if
+      // nothing is allocated from it
+      size_t next = chunk < chunks.size() && used ? chunk + 1 : chunk;
+      if (next == chunks.size()) {
+        chunk_t empty = {0, 0};
+        chunks.push_back(empty);
+      }
+      chunk_t &grown = chunks[next];
+      if (grown.size < size) {
+        size_t bytes = grown.size * 2 > chunk_size ? grown.size * 2
+                                                   : chunk_size;
+        if (bytes < size) {
+          bytes = size;
+        }
+        char *data = static_cast<char *>(malloc(bytes));
+        if (!data) {
+          return 0;
+        }
+        free(grown.data);
+        grown.data = data;
+        grown.size = bytes;
+      }
+      chunk = next;
+      used = size;
+      return grown.data;
     }
-    return *fuseptr;
+
+    // a string to assign to, kept with its capacity
+    std::string &string() {
+      if (strings_used == strings.size()) {
+        strings.push_back(std::string());
+      }
+      return strings[strings_used++];
+    }
+
+  private:
+    static const size_t alignment = 16;
+    static const size_t chunk_size = 64 << 10;
+
+    struct chunk_t {
+      char *data;
+      size_t size;
+    };
+
+    arena() : depth(0), chunk(0), used(0), strings_used(0) {}
+    ~arena() {
+      for (size_t idx = 0; idx < chunks.size(); ++idx) {
+        free(chunks[idx].data);
+      }
+    }
+    arena(const arena &);
+    arena &operator=(const arena &);
+
+    static void create_arena_key() {
+      pthread_key_create(&arena_key, exit_arena);
+    }
+    static void exit_arena(void *ptr) {
+      thread_arena = 0;
+      delete static_cast<arena *>(ptr);
+    }
+
+    static pthread_key_t arena_key;
+    static pthread_once_t arena_once;
+    static thread_local arena *thread_arena;
+
+    std::vector<chunk_t> chunks;
+    // the chunk allocated from, and how much of it
+    size_t chunk;
+    size_t used;
+    // references stay valid as it grows
+    std::deque<std::string> strings;
+    size_t strings_used;
+  };
+
+  // scratch memory allocated from here on is released at the end
+  class frame {
+  public:
+    frame() : memory(arena::get()), start(memory.mark()) { ++memory.depth; }
+    ~frame() {
+      --memory.depth;
+      memory.release(start);
+    }
+
+  private:
+    frame(const frame &);
+    frame &operator=(const frame &);
+
+    arena &memory;
+    arena::mark_t start;
+  };
+
+  // a path_t as a std::string, reusing the string it views if any, or
+  // else one of the thread's arena
+  class string {
+  public:
+    string(const path_t &path) : source(path.source), copy(0) {
+      if (!source) {
+        arena &memory = arena::get();
+        start = memory.mark();
+        copy = &memory.string();
+        copy->assign(path.data(), path.size());
+      }
+    }
+    ~string() {
+      if (copy) {
+        arena::get().release(start);
+      }
+    }
+    operator const std::string &() const { return source ? *source : *copy; }
+
+  private:
+    string(const string &);
+    string &operator=(const string &);
+
+    const std::string *source;
+    std::string *copy;
+    arena::mark_t start;
+  };
+
+  // What fi->fh holds for libfuse between open and release
+  //
+  // Owning fi->fh lets a handle_t and a plain filesystem fh coexist:
+  // operations always see the fh set by the filesystem, swapped back in
+  // by open_file for the duration of the call.
+  struct file {
+    uint64_t fh;
+    handle_t *handle;
+    // the handle, if it writes back
+    writeback_handle_t *writeback;
+    // the path it was opened by, if a cache is enabled, see path_of()
+    std::string path;
+    // fuse::renames then
+    uint64_t renames;
+  };
+
+  // the handle attached by set_handle(), or of the open file in use
+  static thread_local handle_t *current_handle;
+
+  class open_file {
+  public:
+    open_file(struct fuse_file_info *fi)
+        : fi(fi), record(fi ? (file *)(uintptr_t)fi->fh : 0) {
+      if (record) {
+        fi->fh = record->fh;
+        current_handle = record->handle;
+      }
+    }
+    ~open_file() {
+      if (record) {
+        fi->fh = (uintptr_t)record;
+        current_handle = 0;
+      }
+    }
+
+    handle_t *handle() const { return record ? record->handle : 0; }
+    file *entry() const { return record; }
+
+    // after release: delete the handle and the record
+    void close() {
+      if (record) {
+        delete record->handle;
+        delete record;
+        record = 0;
+        current_handle = 0;
+      }
+    }
+
+  private:
+    struct fuse_file_info *fi;
+    file *record;
+  };
+
+  // called with the result of open, create or opendir
+  static int opened(class fuse &fs, const char *pathname, int result,
+                    struct fuse_file_info *fi) {
+    handle_t *handle = current_handle;
+    current_handle = 0;
+    if (result != 0) {
+      delete handle;
+      return result;
+    }
+    file *record = new file;
+    record->fh = fi->fh;
+    record->handle = handle;
+    record->writeback = dynamic_cast<writeback_handle_t *>(handle);
+    record->renames = __atomic_load_n(&fs.renames, __ATOMIC_ACQUIRE);
+    if (pathname && (caching(fs) || fs.config.read_cache_size)) {
+      record->path = pathname;
+    }
+    fi->fh = (uintptr_t)record;
+    return 0;
+  }
+
+  // the path an operation on an open file changes: the one given or,
+  // with nullpath_ok, the one the file was opened by, unless anything
+  // was renamed since; NULL if not known
+  static const char *path_of(class fuse &fs, const char *pathname,
+                             const file *record) {
+    if (pathname || !record || record->path.empty() ||
+        record->renames != __atomic_load_n(&fs.renames, __ATOMIC_ACQUIRE)) {
+      return pathname;
+    }
+    return record->path.c_str();
+  }
+
+  // read() and write() of a path or of a handle, for the bufvec helpers
+  class path_io {
+  public:
+    path_io(class fuse &fs, path_t pathname, struct fuse_file_info *fi)
+        : fs(fs), pathname(pathname), fi(fi) {}
+    int read(char *buf, size_t count, off_t offset) const {
+      return fs.read(pathname, buf, count, offset, fi);
+    }
+    int read_buf(struct fuse_bufvec **bufp, size_t size, off_t off) const {
+      return fs.read_buf(pathname, bufp, size, off, fi);
+    }
+    int write(const char *buf, size_t count, off_t offset) const {
+      return fs.write(pathname, buf, count, offset, fi);
+    }
+
+  private:
+    class fuse &fs;
+    path_t pathname;
+    struct fuse_file_info *fi;
+  };
+  class handle_io {
+  public:
+    handle_io(handle_t &handle, struct fuse_file_info *fi)
+        : handle(handle), fi(fi) {}
+    int read(char *buf, size_t count, off_t offset) const {
+      return handle.read(buf, count, offset, fi);
+    }
+    int read_buf(struct fuse_bufvec **bufp, size_t size, off_t off) const {
+      return handle.read_buf(bufp, size, off, fi);
+    }
+    int write(const char *buf, size_t count, off_t offset) const {
+      return handle.write(buf, count, offset, fi);
+    }
+
+  private:
+    handle_t &handle;
+    struct fuse_file_info *fi;
+  };
+
+  /* the read cache */
+
+  // read() through read_buf(), copying out of whatever buffers it returns
+  template <class IO> class buf_io {
+  public:
+    buf_io(const IO &io) : io(io) {}
+    int read(char *buf, size_t count, off_t offset) const {
+      struct fuse_bufvec *src = 0;
+      int result = io.read_buf(&src, count, offset);
+      if (result >= 0 && src) {
+        struct fuse_bufvec dst;
+        memset(&dst, 0, sizeof(dst));
+        dst.count = 1;
+        dst.buf[0].mem = buf;
+        dst.buf[0].size = count;
+        result = fuse_buf_copy(&dst, src, (fuse_buf_copy_flags)0);
+      }
+      if (src) {
+        for (size_t i = 0; i < src->count; ++i) {
+          if (!(src->buf[i].flags & FUSE_BUF_IS_FD)) {
+            free(src->buf[i].mem);
+          }
+        }
+        free(src);
+      }
+      return result;
+    }
+
+  private:
+    IO io;
+  };
+
+  // read a whole block, short only at the end of the file
+  template <class IO>
+  static int read_block(const IO &io, char *buf, size_t size, off_t offset) {
+    size_t done = 0;
+    while (done < size) {
+      int result = io.read(buf + done, size - done, offset + done);
+      if (result < 0) {
+        return result;
+      }
+      if (result == 0) {
+        break;
+      }
+      done += result;
+    }
+    return done;
+  }
+
+  // read, through the read cache if enabled
+  template <class IO>
+  static int cached_read(class fuse &fs, const char *pathname, file *record,
+                         struct fuse_file_info *fi, char *buf, size_t count,
+                         off_t offset, const IO &io) {
+    if (!pathname || !fs.config.read_cache_size) {
+      return io.read(buf, count, offset);
+    }
+    if (record && record->writeback) {
+      // what it buffers is newer than the cache
+      record->writeback->settle();
+    }
+    path_t path(pathname);
+    size_t block_size = fs.config.read_cache_block;
+    frame memory;
+    char *block = 0;
+    int result = 0;
+    size_t done = 0;
+    while (done < count) {
+      off_t pos = offset + done;
+      uint64_t index = pos / block_size;
+      size_t skip = pos % block_size;
+      size_t size;
+      if (!fs.blocks->get(path, index, skip, buf + done, count - done, size)) {
+        if (!block && !(block = (char *)scratch(block_size))) {
+          result = -ENOMEM;
+          break;
+        }
+        uint64_t since = fs.blocks->current();
+        result = read_block(io, block, block_size, index * block_size);
+        if (result < 0) {
+          break;
+        }
+        size = result;
+        fs.blocks->put(fs.config, path, index, block, size, since, false);
+        if (skip < size) {
+          memcpy(buf + done, block + skip, std::min(count - done, size - skip));
+        }
+      }
+      done += skip < size ? std::min(count - done, size - skip) : 0;
+      if (size < block_size) {
+        // the end of the file
+        break;
+      }
+    }
+    if (done == 0 && result < 0) {
+      return result;
+    }
+    if (record) {
+      fs.blocks->read_ahead(fs, path, record, fi, offset, done);
+    }
+    return done;
+  }
+
+  // cached_read() for the bufvec helpers
+  template <class IO> class cached_io {
+  public:
+    cached_io(class fuse &fs, const char *pathname, file *record,
+              struct fuse_file_info *fi, const IO &io)
+        : fs(fs), pathname(pathname), record(record), fi(fi), io(io) {}
+    int read(char *buf, size_t count, off_t offset) const {
+      return cached_read(fs, pathname, record, fi, buf, count, offset, io);
+    }
+
+  private:
+    class fuse &fs;
+    const char *pathname;
+    file *record;
+    struct fuse_file_info *fi;
+    IO io;
+  };
+
+  // a block read ahead by the read cache's thread
+  static int read_ahead(class fuse &fs, path_t pathname, file *record,
+                        struct fuse_file_info *fi, char *buf, size_t size,
+                        off_t offset) {
+    // an operation of its own, as far as the filesystem can tell
+    frame memory;
+    fi->fh = record->fh;
+    current_handle = record->handle;
+    int result =
+        record->handle
+            ? read_block(buf_io<handle_io>(handle_io(*record->handle, fi)),
+                         buf, size, offset)
+            : read_block(buf_io<path_io>(path_io(fs, pathname, fi)), buf,
+                         size, offset);
+    current_handle = 0;
+    return result;
+  }
+
+  /* the attribute cache */
+
+  static bool caching(const class fuse &fs) {
+    return fs.config.cache_attr_timeout > 0 ||
+           fs.config.cache_negative_timeout > 0;
+  }
+
+  // getattr, through the cache if enabled
+  static int cached_getattr(class fuse &fs, const char *pathname,
+                            struct stat *buf, struct fuse_file_info *fi) {
+    if (!pathname || !caching(fs)) {
+      return fs.getattr(view(pathname), buf, fi);
+    }
+    path_t path(pathname);
+    int result;
+    if (fs.cache->get(path, buf, result)) {
+      return result;
+    }
+    uint64_t since = fs.cache->current();
+    result = fs.getattr(path, buf, fi);
+    fs.cache->put(fs.config, path, buf, result, since);
+    return result;
+  }
+
+  // after an operation that may have changed a path, see attr_cache
+  // before an operation that may write back an open file
+  static void track(class fuse &fs, const char *pathname, file *record) {
+    if (record && record->writeback) {
+      record->writeback->track(fs, path_of(fs, pathname, record));
+    }
+  }
+
+  // before an operation on an open file that must see what it buffers
+  static void settle(class fuse &fs, const char *pathname, file *record) {
+    if (record && record->writeback) {
+      track(fs, pathname, record);
+      record->writeback->settle();
+    }
+  }
+
+  // changed() by an operation on an open file
+  static int changed(class fuse &fs, const char *pathname,
+                     const file *record, int what, int result) {
+    return changed(fs, path_of(fs, pathname, record), what, result);
+  }
+
+  static int changed(class fuse &fs, const char *pathname, int what,
+                     int result) {
+    if (caching(fs)) {
+      fs.cache->changed(pathname, what);
+    }
+    if (fs.config.read_cache_size) {
+      fs.blocks->changed(pathname, what & attr_cache::TREE);
+    }
+    return result;
+  }
+
+#ifdef FUSEXX_STATS
+  // counters of one thread, only ever written by it
+  struct shard {
+    op_stats_t ops[OP_COUNT];
+    shard *next;
+  };
+
+  static pthread_mutex_t shards_lock;
+  // every shard created, for stats()
+  static shard *shards;
+  // shards of exited threads, for reuse by new ones
+  static shard *free_shards;
+  static pthread_key_t shard_key;
+  static pthread_once_t shard_once;
+  static thread_local shard *thread_shard;
+
+  static void create_shard_key() { pthread_key_create(&shard_key, exit_shard); }
+  static void exit_shard(void *ptr) {
+    shard *exited = static_cast<shard *>(ptr);
+    pthread_mutex_lock(&shards_lock);
+    exited->next = free_shards;
+    free_shards = exited;
+    pthread_mutex_unlock(&shards_lock);
+  }
+  static shard &get_shard() {
+    if (!thread_shard) {
+      pthread_once(&shard_once, create_shard_key);
+      pthread_mutex_lock(&shards_lock);
+      if (free_shards) {
+        thread_shard = free_shards;
+        free_shards = free_shards->next;
+      } else {
+        thread_shard = new shard();
+        thread_shard->next = shards;
+        shards = thread_shard;
+      }
+      pthread_mutex_unlock(&shards_lock);
+      pthread_setspecific(shard_key, thread_shard);
+    }
+    return *thread_shard;
+  }
+
+  // single writer: a relaxed load and store, no locked instruction
+  static void add(uint64_t &counter, uint64_t amount) {
+    __atomic_store_n(&counter,
+                     __atomic_load_n(&counter, __ATOMIC_RELAXED) + amount,
+                     __ATOMIC_RELAXED);
+  }
+
+  static uint64_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  }
+#endif // FUSEXX_STATS
+
+  // frames one call of an operation, and counts and times it when built
+  // with FUSEXX_STATS
+  class probe : frame {
+  public:
+#ifdef FUSEXX_STATS
+    probe(operation op) : op(op), start(now()) {}
+
+    int operator()(int result) {
+      record(result, 0);
+      return result;
+    }
+    // for read and write, returning the number of bytes
+    int io(int result) {
+      record(result, result > 0 ? result : 0);
+      return result;
+    }
+    int read_buf(int result, struct fuse_bufvec **bufp) {
+      record(result, result >= 0 && *bufp ? fuse_buf_size(*bufp) : 0);
+      return result;
+    }
+    off_t seek(off_t result) {
+      record(result < 0 ? -1 : 0, 0);
+      return result;
+    }
+
+  private:
+    void record(int result, size_t bytes) {
+      uint64_t elapsed = now() - start;
+      int bucket = elapsed ? 63 - __builtin_clzll(elapsed) : 0;
+      if (bucket >= latency_buckets) {
+        bucket = latency_buckets - 1;
+      }
+      op_stats_t &stats = get_shard().ops[op];
+      add(stats.count, 1);
+      if (result < 0) {
+        add(stats.errors, 1);
+      }
+      add(stats.bytes, bytes);
+      add(stats.nanoseconds, elapsed);
+      add(stats.latency[bucket], 1);
+    }
+
+    operation op;
+    uint64_t start;
+#else  // FUSEXX_STATS
+    probe(operation) {}
+
+    int operator()(int result) { return result; }
+    int io(int result) { return result; }
+    int read_buf(int result, struct fuse_bufvec **) { return result; }
+    off_t seek(off_t result) { return result; }
+#endif // FUSEXX_STATS
+  };
+
+#ifdef FUSEXX_STATS
+  // the contents of stats_text() when opened
+  class stats_file : public handle_t {
+  public:
+    stats_file() : text(stats_text()) {}
+    int read(char *buf, size_t count, off_t offset, struct fuse_file_info *) {
+      if ((size_t)offset >= text.size()) {
+        return 0;
+      }
+      if (count > text.size() - offset) {
+        count = text.size() - offset;
+      }
+      memcpy(buf, text.data() + offset, count);
+      return count;
+    }
+
+  private:
+    std::string text;
+  };
+
+  static bool is_stats_file(class fuse &fs, const char *pathname) {
+    return fs.config.stats_path && pathname &&
+           strcmp(fs.config.stats_path, pathname) == 0;
+  }
+  static int stats_getattr(struct stat *buf) {
+    memset(buf, 0, sizeof(*buf));
+    buf->st_mode = S_IFREG | 0444;
+    buf->st_nlink = 1;
+    buf->st_uid = request_context.uid;
+    buf->st_gid = request_context.gid;
+    return 0;
+  }
+  static int stats_open(struct fuse_file_info *fi) {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+      return -EACCES;
+    }
+    // the size is unknown until read, so bypass the page cache
+    fi->direct_io = 1;
+    set_handle(fi, new stats_file);
+    return 0;
   }
+#endif // FUSEXX_STATS
+
+  // default read_buf: read() into a malloc()ed buffer
+  template <class IO>
+  static int read_bufvec(struct fuse_bufvec **bufp, size_t size, off_t off,
+                         const IO &io);
+
+  // default write_buf: each buffer on to write(), via memory if need be
+  template <class IO>
+  static int write_bufvec(struct fuse_bufvec *bufvec, off_t off,
+                          const IO &io);
 
 #if FUSE_VERSION < 30
   static int getattr(const char *pathname, struct stat *buf) {
-    return fuse().getattr(pathname, buf);
+    probe probe(OP_GETATTR);
+    class fuse &fs = fuse();
+#ifdef FUSEXX_STATS
+    if (is_stats_file(fs, pathname)) {
+      return probe(stats_getattr(buf));
+    }
+#endif
+    return probe(cached_getattr(fs, pathname, buf, 0));
   }
 #else // FUSE_VERSION < 30
   static int getattr(const char *pathname, struct stat *buf,
                      struct fuse_file_info *fi) {
-#warning getattr fuse_file_info unimplemented
-    (void)fi;
-    return fuse().getattr(pathname, buf);
+    probe probe(OP_GETATTR);
+    class fuse &fs = fuse();
+#ifdef FUSEXX_STATS
+    if (is_stats_file(fs, pathname)) {
+      return probe(stats_getattr(buf));
+    }
+#endif
+    open_file file(fi);
+    settle(fs, pathname, file.entry());
+    return probe(cached_getattr(fs, pathname, buf, fi));
   }
 #endif
   static int readlink(const char *pathname, char *buffer, size_t size) {
-    return fuse().readlink(pathname, buffer, size);
+    probe probe(OP_READLINK);
+    return probe(fuse().readlink(view(pathname), buffer, size));
   }
   static int mknod(const char *pathname, mode_t mode, dev_t dev) {
-    return fuse().mknod(pathname, mode, dev);
+    probe probe(OP_MKNOD);
+    class fuse &fs = fuse();
+    return probe(changed(fs, pathname, attr_cache::PARENT,
+                         fs.mknod(view(pathname), mode, dev)));
   }
   static int mkdir(const char *pathname, mode_t mode) {
-    return fuse().mkdir(pathname, mode);
+    probe probe(OP_MKDIR);
+    class fuse &fs = fuse();
+    return probe(changed(fs, pathname, attr_cache::PARENT,
+                         fs.mkdir(view(pathname), mode)));
+  }
+  static int unlink(const char *pathname) {
+    probe probe(OP_UNLINK);
+    class fuse &fs = fuse();
+    return probe(
+        changed(fs, pathname, attr_cache::PARENT, fs.unlink(view(pathname))));
+  }
+  static int rmdir(const char *pathname) {
+    probe probe(OP_RMDIR);
+    class fuse &fs = fuse();
+    return probe(
+        changed(fs, pathname, attr_cache::PARENT, fs.rmdir(view(pathname))));
   }
-  static int unlink(const char *pathname) { return fuse().unlink(pathname); }
-  static int rmdir(const char *pathname) { return fuse().rmdir(pathname); }
   static int symlink(const char *target, const char *linkpath) {
-    return fuse().symlink(target, linkpath);
+    probe probe(OP_SYMLINK);
+    class fuse &fs = fuse();
+    return probe(changed(fs, linkpath, attr_cache::PARENT,
+                         fs.symlink(view(target), view(linkpath))));
   }
 #if FUSE_VERSION < 30
   static int rename(const char *oldpath, const char *newpath) {
-    return fuse().rename(oldpath, newpath);
+    probe probe(OP_RENAME);
+    class fuse &fs = fuse();
+    // paths kept by open files may not name them any more
+    __atomic_add_fetch(&fs.renames, 1, __ATOMIC_ACQ_REL);
+    int result = fs.rename(view(oldpath), view(newpath), 0);
+    changed(fs, oldpath, attr_cache::PARENT | attr_cache::TREE, 0);
+    changed(fs, newpath, attr_cache::PARENT | attr_cache::TREE, 0);
+    return probe(result);
   }
 #else // FUSE_VERSION < 30
   static int rename(const char *oldpath, const char *newpath,
                     unsigned int flags) {
-    return fuse().rename(oldpath, newpath, flags);
+    probe probe(OP_RENAME);
+    class fuse &fs = fuse();
+    // paths kept by open files may not name them any more
+    __atomic_add_fetch(&fs.renames, 1, __ATOMIC_ACQ_REL);
+    int result = fs.rename(view(oldpath), view(newpath), flags);
+    changed(fs, oldpath, attr_cache::PARENT | attr_cache::TREE, 0);
+    changed(fs, newpath, attr_cache::PARENT | attr_cache::TREE, 0);
+    return probe(result);
   }
 #endif
   static int link(const char *oldpath, const char *newpath) {
-    return fuse().link(oldpath, newpath);
+    probe probe(OP_LINK);
+    class fuse &fs = fuse();
+    int result = fs.link(view(oldpath), view(newpath));
+    // the link count of the file changed too
+    changed(fs, oldpath, 0, 0);
+    changed(fs, newpath, attr_cache::PARENT, 0);
+    return probe(result);
   }
 #if FUSE_VERSION < 30
   static int chmod(const char *pathname, mode_t mode) {
-    return fuse().chmod(pathname, mode);
+    probe probe(OP_CHMOD);
+    class fuse &fs = fuse();
+    return probe(changed(fs, pathname, 0, fs.chmod(view(pathname), mode, 0)));
   }
   static int chown(const char *pathname, uid_t uid, gid_t gid) {
-    return fuse().chown(pathname, uid, gid);
+    probe probe(OP_CHOWN);
+    class fuse &fs = fuse();
+    return probe(
+        changed(fs, pathname, 0, fs.chown(view(pathname), uid, gid, 0)));
   }
   static int truncate(const char *path, off_t length) {
-    return fuse().truncate(path, length);
+    probe probe(OP_TRUNCATE);
+    class fuse &fs = fuse();
+    return probe(changed(fs, path, 0, fs.truncate(view(path), length, 0)));
   }
 #else // FUSE_VERSION < 30
   static int chmod(const char *pathname, mode_t mode,
                    struct fuse_file_info *fi) {
-#warning chmod fuse_file_info unimplemented
-    (void)fi;
-    return fuse().chmod(pathname, mode);
+    probe probe(OP_CHMOD);
+    class fuse &fs = fuse();
+    open_file file(fi);
+    return probe(changed(fs, pathname, file.entry(), 0,
+                         fs.chmod(view(pathname), mode, fi)));
   }
   static int chown(const char *pathname, uid_t uid, gid_t gid,
                    struct fuse_file_info *fi) {
-#warning chown fuse_file_info unimplemented
-    (void)fi;
-    return fuse().chown(pathname, uid, gid);
+    probe probe(OP_CHOWN);
+    class fuse &fs = fuse();
+    open_file file(fi);
+    return probe(changed(fs, pathname, file.entry(), 0,
+                         fs.chown(view(pathname), uid, gid, fi)));
   }
-  static int truncate(const char *path, off_t length,
+  static int truncate(const char *pathname, off_t length,
                       struct fuse_file_info *fi) {
-#warning truncate fuse_file_info unimplemented
-    (void)fi;
-    return fuse().truncate(path, length);
+    probe probe(OP_TRUNCATE);
+    class fuse &fs = fuse();
+    open_file file(fi);
+    settle(fs, pathname, file.entry());
+    return probe(changed(fs, pathname, file.entry(), 0,
+                         fs.truncate(view(pathname), length, fi)));
   }
 #endif
   static int open(const char *pathname, struct fuse_file_info *fi) {
-    return fuse().open(pathname, fi);
+    probe probe(OP_OPEN);
+    class fuse &fs = fuse();
+    current_handle = 0;
+#ifdef FUSEXX_STATS
+    if (is_stats_file(fs, pathname)) {
+      return probe(opened(fs, pathname, stats_open(fi), fi));
+    }
+#endif
+    int result = fs.open(view(pathname), fi);
+    if (fi->flags & O_TRUNC) {
+      changed(fs, pathname, 0, result);
+    }
+    return probe(opened(fs, pathname, result, fi));
   }
   static int read(const char *pathname, char *buf, size_t count, off_t offset,
                   struct fuse_file_info *fi) {
-    return fuse().read(pathname, buf, count, offset, fi);
+    probe probe(OP_READ);
+    class fuse &fs = fuse();
+    open_file file(fi);
+    track(fs, pathname, file.entry());
+#ifdef FUSEXX_STATS
+    if (is_stats_file(fs, pathname)) {
+      // made anew by every read, so not cached
+      return probe.io(file.handle()->read(buf, count, offset, fi));
+    }
+#endif
+    if (file.handle()) {
+      return probe.io(cached_read(fs, pathname, file.entry(), fi, buf, count,
+                                  offset, handle_io(*file.handle(), fi)));
+    }
+    return probe.io(cached_read(fs, pathname, file.entry(), fi, buf, count,
+                                offset, path_io(fs, view(pathname), fi)));
   }
   static int write(const char *pathname, const char *buf, size_t count,
                    off_t offset, struct fuse_file_info *fi) {
-    return fuse().write(pathname, buf, count, offset, fi);
+    probe probe(OP_WRITE);
+    class fuse &fs = fuse();
+    open_file file(fi);
+    track(fs, pathname, file.entry());
+    if (file.handle()) {
+      return probe.io(changed(fs, pathname, file.entry(), 0,
+                              file.handle()->write(buf, count, offset, fi)));
+    }
+    return probe.io(changed(fs, pathname, file.entry(), 0,
+                            fs.write(view(pathname), buf, count, offset, fi)));
   }
   static int statfs(const char *path, struct statvfs *buf) {
-    return fuse().statfs(path, buf);
+    probe probe(OP_STATFS);
+    return probe(fuse().statfs(view(path), buf));
   }
   static int flush(const char *pathname, struct fuse_file_info *fi) {
-    return fuse().flush(pathname, fi);
+    probe probe(OP_FLUSH);
+    class fuse &fs = fuse();
+    open_file file(fi);
+    track(fs, pathname, file.entry());
+    if (file.handle()) {
+      return probe(file.handle()->flush(fi));
+    }
+    return probe(fs.flush(view(pathname), fi));
   }
   static int release(const char *pathname, struct fuse_file_info *fi) {
-    return fuse().release(pathname, fi);
+    probe probe(OP_RELEASE);
+    class fuse &fs = fuse();
+    open_file file(fi);
+    track(fs, pathname, file.entry());
+    if (file.entry() && fs.config.read_cache_size) {
+      fs.blocks->closing(file.entry());
+    }
+    int result = file.handle() ? file.handle()->release(fi)
+                               : fs.release(view(pathname), fi);
+    file.close();
+    return probe(result);
   }
 
 #if FUSE_VERSION > 21
   static int fsync(const char *pathname, int datasync,
                    struct fuse_file_info *fi) {
-    return fuse().fsync(pathname, datasync, fi);
+    probe probe(OP_FSYNC);
+    class fuse &fs = fuse();
+    open_file file(fi);
+    track(fs, pathname, file.entry());
+    if (file.handle()) {
+      return probe(file.handle()->fsync(datasync, fi));
+    }
+    return probe(fs.fsync(view(pathname), datasync, fi));
   }
   static int setxattr(const char *path, const char *name, const char *value,
                       size_t size, int flags) {
-    return fuse().setxattr(path, name, value, size, flags);
+    probe probe(OP_SETXATTR);
+    class fuse &fs = fuse();
+    return probe(changed(
+        fs, path, 0, fs.setxattr(view(path), view(name), value, size, flags)));
   }
   static int getxattr(const char *path, const char *name, char *value,
                       size_t size) {
-    return fuse().getxattr(path, name, value, size);
+    probe probe(OP_GETXATTR);
+    return probe(fuse().getxattr(view(path), view(name), value, size));
   }
   static int listxattr(const char *path, char *list, size_t size) {
-    return fuse().listxattr(path, list, size);
+    probe probe(OP_LISTXATTR);
+    return probe(fuse().listxattr(view(path), list, size));
   }
   static int removexattr(const char *path, const char *name) {
-    return fuse().removexattr(path, name);
+    probe probe(OP_REMOVEXATTR);
+    class fuse &fs = fuse();
+    return probe(
+        changed(fs, path, 0, fs.removexattr(view(path), view(name))));
   }
 #endif // FUSE_VERSION > 21
 
   static thread_local void *filler_handle;
 #if FUSE_VERSION > 22
   static int opendir(const char *opendir, struct fuse_file_info *fi) {
-    return fuse().opendir(opendir, fi);
+    probe probe(OP_OPENDIR);
+    current_handle = 0;
+    class fuse &fs = fuse();
+    // no operation on a directory changes it through its handle
+    return probe(opened(fs, 0, fs.opendir(view(opendir), fi), fi));
   }
 
   static thread_local fuse_fill_dir_t filler;
@@ -160,30 +1656,111 @@ public:
                      off_t off, struct fuse_file_info *fi,
                      enum fuse_readdir_flags flags) {
 #endif
+    probe probe(OP_READDIR);
+    class fuse &fs = fuse();
+    open_file file(fi);
     detail::filler_handle = buf;
     detail::filler = filler;
-    return fuse().readdir(pathname, off, fi, (fuse::readdir_flags)flags);
+    if (file.handle()) {
+      return probe(file.handle()->readdir(off, fi, (readdir_flags)flags));
+    }
+    return probe(fs.readdir(view(pathname), off, fi, (readdir_flags)flags));
   }
 
   static int releasedir(const char *pathname, struct fuse_file_info *fi) {
-    return fuse().releasedir(pathname, fi);
+    probe probe(OP_RELEASEDIR);
+    class fuse &fs = fuse();
+    open_file file(fi);
+    int result = file.handle() ? file.handle()->release(fi)
+                               : fs.releasedir(view(pathname), fi);
+    file.close();
+    return probe(result);
   }
   static int fsyncdir(const char *pathname, int datasync,
                       struct fuse_file_info *fi) {
-    return fuse().fsyncdir(pathname, datasync, fi);
+    probe probe(OP_FSYNCDIR);
+    class fuse &fs = fuse();
+    open_file file(fi);
+    if (file.handle()) {
+      return probe(file.handle()->fsync(datasync, fi));
+    }
+    return probe(fs.fsyncdir(view(pathname), datasync, fi));
   }
 
-#if FUSE_VERSION < 30
-  static void *init(struct fuse_conn_info *conn) {
-    struct {
-    } cfg;
-#else // FUSE_VERSION < 30
-  static void *init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
-#warning init fuse config unimplemented
+  static void want(struct fuse_conn_info *conn, unsigned cap,
+                   fuse::config_flag flag) {
+    if (flag == FLAG_OFF) {
+      conn->want &= ~cap;
+    } else if (flag == FLAG_ON && (conn->capable & cap)) {
+      conn->want |= cap;
+    }
+  }
+  static void set(int &field, fuse::config_flag flag) {
+    if (flag != FLAG_DEFAULT) {
+      field = flag;
+    }
+  }
+  static void set(double &field, double seconds) {
+    if (seconds >= 0) {
+      field = seconds;
+    }
+  }
+
+#if FUSE_VERSION < 30
+  static void *init(struct fuse_conn_info *conn) {
+    struct fuse_config *cfg = 0;
+#else // FUSE_VERSION < 30
+  static void *init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+#endif
+    class fuse *fuseptr = &fuse();
+    const fuse::config_t &config = fuseptr->config;
+
+    if (config.read_cache_size && !config.read_cache_block) {
+      fprintf(stderr, "fuse: read_cache_block is 0, using 128 KiB\n");
+      fuseptr->config.read_cache_block = 128 << 10;
+    }
+    if (config.max_write) {
+      conn->max_write = config.max_write;
+    }
+    if (config.max_readahead) {
+      conn->max_readahead = config.max_readahead;
+    }
+#if FUSE_VERSION >= 29
+    if (config.max_background) {
+      conn->max_background = config.max_background;
+    }
+    if (config.congestion_threshold) {
+      conn->congestion_threshold = config.congestion_threshold;
+    }
+#endif
+#ifdef FUSE_CAP_SPLICE_READ
+    want(conn, FUSE_CAP_SPLICE_READ, config.splice_read);
+    want(conn, FUSE_CAP_SPLICE_WRITE, config.splice_write);
+    want(conn, FUSE_CAP_SPLICE_MOVE, config.splice_move);
+#endif
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+    want(conn, FUSE_CAP_WRITEBACK_CACHE, config.writeback_cache);
+#endif
+#ifdef FUSE_CAP_PARALLEL_DIROPS
+    want(conn, FUSE_CAP_PARALLEL_DIROPS, config.parallel_dirops);
+#endif
+#ifdef FUSE_CAP_ASYNC_DIO
+    want(conn, FUSE_CAP_ASYNC_DIO, config.async_dio);
+#endif
+
+#if FUSE_VERSION >= 30
+    set(cfg->entry_timeout, config.entry_timeout);
+    set(cfg->attr_timeout, config.attr_timeout);
+    set(cfg->negative_timeout, config.negative_timeout);
+    set(cfg->kernel_cache, config.kernel_cache);
+    set(cfg->auto_cache, config.auto_cache);
+    set(cfg->nullpath_ok, config.nullpath_ok);
+    set(cfg->use_ino, config.use_ino);
+    set(cfg->direct_io, config.direct_io);
+    set(cfg->hard_remove, config.hard_remove);
 #endif
-    class fuse *fuseptr = &fuse();
-    (void)conn;
-    (void)cfg;
+
+    fuseptr->configure(conn, cfg);
     fuseptr->init();
     return fuseptr;
   }
@@ -195,65 +1772,161 @@ public:
   static thread_local fuse_dirfil_t filler;
   static int getdir(const char *pathname, fuse_dirh_t handle,
                     fuse_dirfil_t filler) {
+    probe probe(OP_READDIR);
     detail::filler_handle = handle;
     detail::filler = filler;
-    return fuse().readdir(pathname, 0, 0);
+    return probe(fuse().readdir(view(pathname), 0, 0, (readdir_flags)0));
   }
 #endif // FUSE_VERSION > 22
 
 #if FUSE_VERSION >= 25
   static int access(const char *pathname, int mode) {
-    return fuse().access(pathname, mode);
+    probe probe(OP_ACCESS);
+    return probe(fuse().access(view(pathname), mode));
   }
   static int create(const char *pathname, mode_t mode,
                     struct fuse_file_info *fi) {
-    return fuse().create(pathname, mode, fi);
+    probe probe(OP_CREATE);
+    class fuse &fs = fuse();
+    current_handle = 0;
+    int result = fs.create(view(pathname), mode, fi);
+    changed(fs, pathname, attr_cache::PARENT, result);
+    return probe(opened(fs, pathname, result, fi));
+  }
+#if FUSE_VERSION < 30
+  static int ftruncate(const char *pathname, off_t length,
+                       struct fuse_file_info *fi) {
+    probe probe(OP_TRUNCATE);
+    class fuse &fs = fuse();
+    open_file file(fi);
+    settle(fs, pathname, file.entry());
+    return probe(changed(fs, pathname, file.entry(), 0,
+                         fs.truncate(view(pathname), length, fi)));
+  }
+  static int fgetattr(const char *pathname, struct stat *buf,
+                      struct fuse_file_info *fi) {
+    probe probe(OP_GETATTR);
+    class fuse &fs = fuse();
+#ifdef FUSEXX_STATS
+    if (is_stats_file(fs, pathname)) {
+      return probe(stats_getattr(buf));
+    }
+#endif
+    open_file file(fi);
+    settle(fs, pathname, file.entry());
+    return probe(cached_getattr(fs, pathname, buf, fi));
   }
+#endif // FUSE_VERSION < 30
 #endif // FUSE_VERSION >= 25
 
 #if FUSE_VERSION >= 26
   static int lock(const char *pathname, struct fuse_file_info *fi, int cmd,
                   struct flock *lock) {
-    return fuse().lock(pathname, fi, cmd, lock);
+    probe probe(OP_LOCK);
+    open_file file(fi);
+    return probe(fuse().lock(view(pathname), fi, cmd, lock));
   }
 #if FUSE_VERSION < 30
   static int utimens(const char *pathname, const struct timespec tv[2]) {
-    return fuse().utimens(pathname, tv);
+    probe probe(OP_UTIMENS);
+    class fuse &fs = fuse();
+    return probe(changed(fs, pathname, 0, fs.utimens(view(pathname), tv, 0)));
   }
 #else // FUSE_VERSION < 30
   static int utimens(const char *pathname, const struct timespec tv[2],
                      struct fuse_file_info *fi) {
-#warning utimens fuse_file_info unimplemented
-    (void)fi;
-    return fuse().utimens(pathname, tv);
+    probe probe(OP_UTIMENS);
+    class fuse &fs = fuse();
+    open_file file(fi);
+    return probe(changed(fs, pathname, file.entry(), 0,
+                         fs.utimens(view(pathname), tv, fi)));
   }
 #endif
   static int bmap(const char *pathname, size_t blocksize, uint64_t *idx) {
-    return fuse().bmap(pathname, blocksize, idx);
+    probe probe(OP_BMAP);
+    return probe(fuse().bmap(view(pathname), blocksize, idx));
   }
   static int ioctl(const char *pathname, int cmd, void *arg,
                    struct fuse_file_info *fi, unsigned int flags, void *data) {
-    return fuse().ioctl(pathname, cmd, arg, fi, flags, data);
+    probe probe(OP_IOCTL);
+    open_file file(fi);
+    return probe(fuse().ioctl(view(pathname), cmd, arg, fi, flags, data));
   }
   static int poll(const char *pathname, struct fuse_file_info *fi,
                   struct fuse_pollhandle *ph, unsigned *reventsp) {
-    return fuse().poll(pathname, fi, ph, reventsp);
+    probe probe(OP_POLL);
+    open_file file(fi);
+    return probe(fuse().poll(view(pathname), fi, ph, reventsp));
   }
   static int write_buf(const char *pathname, struct fuse_bufvec *buf, off_t off,
                        struct fuse_file_info *fi) {
-    return fuse().write_buf(pathname, buf, off, fi);
+    probe probe(OP_WRITE_BUF);
+    class fuse &fs = fuse();
+    open_file file(fi);
+    track(fs, pathname, file.entry());
+    if (file.handle()) {
+      return probe.io(changed(fs, pathname, file.entry(), 0,
+                              file.handle()->write_buf(buf, off, fi)));
+    }
+    return probe.io(changed(fs, pathname, file.entry(), 0,
+                            fs.write_buf(view(pathname), buf, off, fi)));
   }
   static int read_buf(const char *pathname, struct fuse_bufvec **bufp,
                       size_t size, off_t off, struct fuse_file_info *fi) {
-    return fuse().read_buf(pathname, bufp, size, off, fi);
+    probe probe(OP_READ_BUF);
+    class fuse &fs = fuse();
+    open_file file(fi);
+    track(fs, pathname, file.entry());
+#ifdef FUSEXX_STATS
+    if (is_stats_file(fs, pathname)) {
+      int result = file.handle()->read_buf(bufp, size, off, fi);
+      return probe.read_buf(result, bufp);
+    }
+#endif
+    if (pathname && fs.config.read_cache_size) {
+      int result =
+          file.handle()
+              ? read_bufvec(bufp, size, off,
+                            cached_io<buf_io<handle_io> >(
+                                fs, pathname, file.entry(), fi,
+                                handle_io(*file.handle(), fi)))
+              : read_bufvec(bufp, size, off,
+                            cached_io<buf_io<path_io> >(
+                                fs, pathname, file.entry(), fi,
+                                path_io(fs, view(pathname), fi)));
+      return probe.read_buf(result, bufp);
+    }
+    if (file.handle()) {
+      int result = file.handle()->read_buf(bufp, size, off, fi);
+      return probe.read_buf(result, bufp);
+    }
+    int result = fs.read_buf(view(pathname), bufp, size, off, fi);
+    return probe.read_buf(result, bufp);
   }
   static int flock(const char *pathname, struct fuse_file_info *fi, int op) {
-    return fuse().flock(pathname, fi, op);
+    probe probe(OP_FLOCK);
+    open_file file(fi);
+    return probe(fuse().flock(view(pathname), fi, op));
   }
   static int fallocate(const char *pathname, int mode, off_t offset, off_t len,
                        struct fuse_file_info *fi) {
-    return fuse().fallocate(pathname, mode, offset, len, fi);
+    probe probe(OP_FALLOCATE);
+    class fuse &fs = fuse();
+    open_file file(fi);
+    settle(fs, pathname, file.entry());
+    return probe(changed(fs, pathname, file.entry(), 0,
+                         fs.fallocate(view(pathname), mode, offset, len, fi)));
+  }
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+  static off_t lseek(const char *pathname, off_t off, int whence,
+                     struct fuse_file_info *fi) {
+    probe probe(OP_LSEEK);
+    class fuse &fs = fuse();
+    open_file file(fi);
+    settle(fs, pathname, file.entry());
+    return probe.seek(fs.lseek(view(pathname), off, whence, fi));
   }
+#endif // FUSE_VERSION >= 3.8
 #else // FUSE_VERSION >= 26
 
   static int utime(const char *pathname, struct utimbuf *times) {
@@ -266,6 +1939,19 @@ public:
 #endif // FUSE_VERSION >= 26
 };
 
+thread_local fuse::context_t fuse::detail::request_context;
+thread_local fuse::handle_t *fuse::detail::current_handle;
+pthread_key_t fuse::detail::arena::arena_key;
+pthread_once_t fuse::detail::arena::arena_once = PTHREAD_ONCE_INIT;
+thread_local fuse::detail::arena *fuse::detail::arena::thread_arena;
+#ifdef FUSEXX_STATS
+pthread_mutex_t fuse::detail::shards_lock = PTHREAD_MUTEX_INITIALIZER;
+fuse::detail::shard *fuse::detail::shards;
+fuse::detail::shard *fuse::detail::free_shards;
+pthread_key_t fuse::detail::shard_key;
+pthread_once_t fuse::detail::shard_once = PTHREAD_ONCE_INIT;
+thread_local fuse::detail::shard *fuse::detail::thread_shard;
+#endif
 thread_local void *fuse::detail::filler_handle;
 #if FUSE_VERSION > 22
 thread_local fuse_fill_dir_t fuse::detail::filler;
@@ -273,7 +1959,53 @@ thread_local fuse_fill_dir_t fuse::detail::filler;
 thread_local fuse_dirfil_t fuse::detail::filler;
 #endif
 
+void *fuse::read_cache::work(void *arg) {
+  read_cache &self = *static_cast<read_cache *>(arg);
+  char *buf = 0;
+  size_t buf_size = 0;
+  pthread_mutex_lock(&self.lock);
+  while (!self.stopping) {
+    if (self.jobs.empty()) {
+      pthread_cond_wait(&self.queued, &self.lock);
+      continue;
+    }
+    job_t job = self.jobs.front();
+    self.jobs.pop_front();
+    self.busy = job.record;
+    pthread_mutex_unlock(&self.lock);
+
+    const config_t &config = job.fs->config;
+    size_t size = config.read_cache_block;
+    path_t path(job.path);
+    if (buf_size < size) {
+      free(buf);
+      buf = (char *)malloc(size);
+      buf_size = buf ? size : 0;
+    }
+    if (buf && !self.contains(path, job.index)) {
+      uint64_t since = self.current();
+      int result =
+          detail::read_ahead(*job.fs, path, (detail::file *)job.record,
+                             &job.fi, buf, size, job.index * size);
+      if (result >= 0) {
+        self.put(config, path, job.index, buf, result, since, true);
+      }
+    }
+
+    pthread_mutex_lock(&self.lock);
+    self.busy = 0;
+    pthread_cond_broadcast(&self.idle);
+  }
+  pthread_mutex_unlock(&self.lock);
+  free(buf);
+  return 0;
+}
+
 int fuse::getattr(const std::string &, struct stat *) { return -ENOSYS; }
+int fuse::getattr(const std::string &pathname, struct stat *buf,
+                  struct fuse_file_info *) {
+  return getattr(pathname, buf);
+}
 int fuse::readlink(const std::string &, char *, size_t) { return -ENOSYS; }
 int fuse::mknod(const std::string &, mode_t, dev_t) { return -ENOSYS; }
 int fuse::mkdir(const std::string &, mode_t) { return -ENOSYS; }
@@ -285,8 +2017,20 @@ int fuse::rename(const std::string &, const std::string &, unsigned int) {
 }
 int fuse::link(const std::string &, const std::string &) { return -ENOSYS; }
 int fuse::chmod(const std::string &, mode_t) { return -ENOSYS; }
+int fuse::chmod(const std::string &pathname, mode_t mode,
+                struct fuse_file_info *) {
+  return chmod(pathname, mode);
+}
 int fuse::chown(const std::string &, uid_t, gid_t) { return -ENOSYS; }
+int fuse::chown(const std::string &pathname, uid_t uid, gid_t gid,
+                struct fuse_file_info *) {
+  return chown(pathname, uid, gid);
+}
 int fuse::truncate(const std::string &, off_t) { return -ENOSYS; }
+int fuse::truncate(const std::string &path, off_t length,
+                   struct fuse_file_info *) {
+  return truncate(path, length);
+}
 int fuse::open(const std::string &, struct fuse_file_info *) { return 0; }
 int fuse::read(const std::string &, char *, size_t, off_t,
                struct fuse_file_info *) {
@@ -328,11 +2072,16 @@ int fuse::readdir(const std::string &, off_t, struct fuse_file_info *,
 
 int fuse::fill_dir(const std::string &name, const struct stat *stbuf, off_t off,
                    fuse::fill_dir_flags flags) {
+  return fill_dir(name.c_str(), stbuf, off, flags);
+}
+
+int fuse::fill_dir(const char *name, const struct stat *stbuf, off_t off,
+                   fuse::fill_dir_flags flags) {
 #if FUSE_VERSION < 30
   (void)flags;
-  return detail::filler(detail::filler_handle, name.c_str(), stbuf, off);
+  return detail::filler(detail::filler_handle, name, stbuf, off);
 #else // FUSE_VERSION < 30
-  return detail::filler(detail::filler_handle, name.c_str(), stbuf, off,
+  return detail::filler(detail::filler_handle, name, stbuf, off,
                         (::fuse_fill_dir_flags)flags);
 #endif
 }
@@ -342,11 +2091,17 @@ int fuse::fsyncdir(const std::string &, int, struct fuse_file_info *) {
   return -ENOSYS;
 }
 void fuse::init() {}
+void fuse::configure(struct fuse_conn_info *, struct fuse_config *) {}
 void fuse::destroy() {}
 #else
 int fuse::fill_dir(const std::string &name, const struct stat *stbuf,
-                   off_t off) {
-  return detail::filler(detail::filler_handle, name.c_str(),
+                   off_t off, fuse::fill_dir_flags flags) {
+  return fill_dir(name.c_str(), stbuf, off, flags);
+}
+
+int fuse::fill_dir(const char *name, const struct stat *stbuf, off_t off,
+                   fuse::fill_dir_flags) {
+  return detail::filler(detail::filler_handle, name,
                         (stbuf->st_mode & S_IFMT) >> 12, stbuf->st_ino, 0);
 }
 #endif // FUSE_VERSION > 22
@@ -366,6 +2121,10 @@ int fuse::lock(const std::string &, struct fuse_file_info *, int,
 int fuse::utimens(const std::string &, const struct timespec[2]) {
   return -ENOSYS;
 }
+int fuse::utimens(const std::string &pathname, const struct timespec tv[2],
+                  struct fuse_file_info *) {
+  return utimens(pathname, tv);
+}
 int fuse::bmap(const std::string &, size_t, uint64_t *) { return -ENOSYS; }
 int fuse::ioctl(const std::string &, int, void *, struct fuse_file_info *,
                 unsigned int, void *) {
@@ -376,8 +2135,9 @@ int fuse::poll(const std::string &, struct fuse_file_info *,
   return -ENOSYS;
 }
 
-int fuse::write_buf(const std::string &pathname, struct fuse_bufvec *bufvec,
-                    off_t off, struct fuse_file_info *fi) {
+template <class IO>
+int fuse::detail::write_bufvec(struct fuse_bufvec *bufvec, off_t off,
+                               const IO &io) {
   int total = 0;
   while (bufvec->idx < bufvec->count) {
     struct fuse_buf &buf = bufvec->buf[bufvec->idx];
@@ -385,11 +2145,39 @@ int fuse::write_buf(const std::string &pathname, struct fuse_bufvec *bufvec,
     int subsize = buf.size - bufoff;
     int subtotal;
     if (buf.flags & FUSE_BUF_IS_FD) {
-      return -ENOSYS;
+      // bring pipe or file data into memory for write()
+      frame memory;
+      struct fuse_bufvec src;
+      struct fuse_bufvec dst;
+      src.count = 1;
+      src.idx = 0;
+      src.off = bufoff;
+      src.buf[0] = buf;
+      dst.count = 1;
+      dst.idx = 0;
+      dst.off = 0;
+      dst.buf[0].size = subsize;
+      dst.buf[0].flags = (fuse_buf_flags)0;
+      dst.buf[0].mem = scratch(subsize);
+      dst.buf[0].fd = -1;
+      dst.buf[0].pos = 0;
+      if (!dst.buf[0].mem) {
+        return total ? total : -ENOMEM;
+      }
+      ssize_t copied = fuse_buf_copy(&dst, &src, (fuse_buf_copy_flags)0);
+      if (copied < 0) {
+        return total ? total : (int)copied;
+      }
+      subtotal = io.write((const char *)dst.buf[0].mem, copied, off);
+      if (subtotal >= 0 && copied < subsize) {
+        // pipe drained early, nothing more to write
+        return total + subtotal;
+      }
+    } else {
+      subtotal = io.write((const char *)buf.mem + bufoff, subsize, off);
     }
-    subtotal = write(pathname, (char *)buf.mem + bufoff, subsize, off, fi);
     if (subtotal < 0) {
-      return subtotal;
+      return total ? total : subtotal;
     }
     bufoff += subtotal;
     off += subtotal;
@@ -400,28 +2188,64 @@ int fuse::write_buf(const std::string &pathname, struct fuse_bufvec *bufvec,
     bufoff = 0;
     ++bufvec->idx;
   }
-  return 0;
+  return total;
 }
 
-int fuse::read_buf(const std::string &pathname, struct fuse_bufvec **bufp,
-                   size_t size, off_t off, struct fuse_file_info *fi) {
+template <class IO>
+int fuse::detail::read_bufvec(struct fuse_bufvec **bufp, size_t size,
+                              off_t off, const IO &io) {
   *bufp = (struct fuse_bufvec *)malloc(sizeof(**bufp));
+  if (!*bufp) {
+    return -ENOMEM;
+  }
   struct fuse_bufvec &bufvec = **bufp;
   bufvec.count = 1;
   bufvec.idx = 0;
   bufvec.off = 0;
-  bufvec.buf[0].size = size;
+  bufvec.buf[0].size = 0;
   bufvec.buf[0].flags = (fuse_buf_flags)0;
   bufvec.buf[0].mem = malloc(size);
-  bufvec.buf[0].fd = 0;
+  bufvec.buf[0].fd = -1;
   bufvec.buf[0].pos = 0;
-  ssize_t amount = read(pathname, (char *)bufvec.buf[0].mem, size, off, fi);
-  bufvec.buf[0].size = amount;
-  bufvec.off = amount;
-  bufvec.buf[0].pos = amount;
+  if (!bufvec.buf[0].mem) {
+    return -ENOMEM;
+  }
+  int amount = io.read((char *)bufvec.buf[0].mem, size, off);
+  if (amount > 0) {
+    bufvec.buf[0].size = amount;
+  }
   return amount;
 }
 
+int fuse::write_buf(const std::string &pathname, struct fuse_bufvec *bufvec,
+                    off_t off, struct fuse_file_info *fi) {
+  return detail::write_bufvec(bufvec, off,
+                              detail::path_io(*this, path_t(pathname), fi));
+}
+
+int fuse::read_buf(const std::string &pathname, struct fuse_bufvec **bufp,
+                   size_t size, off_t off, struct fuse_file_info *fi) {
+  return detail::read_bufvec(bufp, size, off,
+                             detail::path_io(*this, path_t(pathname), fi));
+}
+
+int fuse::fd_buf(struct fuse_bufvec **bufp, int fd, size_t size, off_t pos) {
+  *bufp = (struct fuse_bufvec *)malloc(sizeof(**bufp));
+  if (!*bufp) {
+    return -ENOMEM;
+  }
+  struct fuse_bufvec &bufvec = **bufp;
+  bufvec.count = 1;
+  bufvec.idx = 0;
+  bufvec.off = 0;
+  bufvec.buf[0].size = size;
+  bufvec.buf[0].flags = (fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+  bufvec.buf[0].mem = 0;
+  bufvec.buf[0].fd = fd;
+  bufvec.buf[0].pos = pos;
+  return 0;
+}
+
 int fuse::flock(const std::string &, struct fuse_file_info *, int) {
   return -ENOSYS;
 }
@@ -429,13 +2253,638 @@ int fuse::fallocate(const std::string &, int, off_t, off_t,
                     struct fuse_file_info *) {
   return -ENOSYS;
 }
+off_t fuse::lseek(const std::string &, off_t, int, struct fuse_file_info *) {
+  return -ENOSYS;
+}
 #endif // FUSE_VERSION >= 26
 
-fuse::fuse() : uid(0), gid(0), pid(0), umask(022) {}
+// path_t variants, forwarding to the std::string operations
+//
+// The std::string defaults that call other operations go through these in
+// turn, so that overriding either form of the callee works.
 
-int fuse::main(int argc, char *argv[]) {
-  int ret;
-  static struct fuse_operations ops = {
+int fuse::getattr(path_t pathname, struct stat *buf,
+                  struct fuse_file_info *fi) {
+  return getattr(detail::string(pathname), buf, fi);
+}
+int fuse::readlink(path_t pathname, char *buffer, size_t size) {
+  return readlink(detail::string(pathname), buffer, size);
+}
+int fuse::readdir(path_t pathname, off_t off, struct fuse_file_info *fi,
+                  readdir_flags flags) {
+  return readdir(detail::string(pathname), off, fi, flags);
+}
+int fuse::mknod(path_t pathname, mode_t mode, dev_t dev) {
+  return mknod(detail::string(pathname), mode, dev);
+}
+int fuse::mkdir(path_t pathname, mode_t mode) {
+  return mkdir(detail::string(pathname), mode);
+}
+int fuse::unlink(path_t pathname) { return unlink(detail::string(pathname)); }
+int fuse::rmdir(path_t pathname) { return rmdir(detail::string(pathname)); }
+int fuse::symlink(path_t target, path_t linkpath) {
+  return symlink(detail::string(target), detail::string(linkpath));
+}
+int fuse::rename(path_t oldpath, path_t newpath, unsigned int flags) {
+  return rename(detail::string(oldpath), detail::string(newpath), flags);
+}
+int fuse::link(path_t oldpath, path_t newpath) {
+  return link(detail::string(oldpath), detail::string(newpath));
+}
+int fuse::chmod(path_t pathname, mode_t mode, struct fuse_file_info *fi) {
+  return chmod(detail::string(pathname), mode, fi);
+}
+int fuse::chown(path_t pathname, uid_t uid, gid_t gid,
+                struct fuse_file_info *fi) {
+  return chown(detail::string(pathname), uid, gid, fi);
+}
+int fuse::truncate(path_t pathname, off_t length, struct fuse_file_info *fi) {
+  return truncate(detail::string(pathname), length, fi);
+}
+int fuse::open(path_t pathname, struct fuse_file_info *fi) {
+  return open(detail::string(pathname), fi);
+}
+int fuse::read(path_t pathname, char *buf, size_t count, off_t offset,
+               struct fuse_file_info *fi) {
+  return read(detail::string(pathname), buf, count, offset, fi);
+}
+int fuse::write(path_t pathname, const char *buf, size_t count, off_t offset,
+                struct fuse_file_info *fi) {
+  return write(detail::string(pathname), buf, count, offset, fi);
+}
+int fuse::statfs(path_t pathname, struct statvfs *buf) {
+  return statfs(detail::string(pathname), buf);
+}
+int fuse::flush(path_t pathname, struct fuse_file_info *fi) {
+  return flush(detail::string(pathname), fi);
+}
+int fuse::release(path_t pathname, struct fuse_file_info *fi) {
+  return release(detail::string(pathname), fi);
+}
+int fuse::fsync(path_t pathname, int datasync, struct fuse_file_info *fi) {
+  return fsync(detail::string(pathname), datasync, fi);
+}
+int fuse::setxattr(path_t pathname, path_t name, const char *value,
+                   size_t size, int flags) {
+  return setxattr(detail::string(pathname), detail::string(name),
+                  std::string(value, size), size, flags);
+}
+int fuse::getxattr(path_t pathname, path_t name, char *value, size_t size) {
+  return getxattr(detail::string(pathname), detail::string(name), value, size);
+}
+int fuse::listxattr(path_t pathname, char *list, size_t size) {
+  return listxattr(detail::string(pathname), list, size);
+}
+int fuse::removexattr(path_t pathname, path_t name) {
+  return removexattr(detail::string(pathname), detail::string(name));
+}
+int fuse::opendir(path_t pathname, struct fuse_file_info *fi) {
+  return opendir(detail::string(pathname), fi);
+}
+int fuse::releasedir(path_t pathname, struct fuse_file_info *fi) {
+  return releasedir(detail::string(pathname), fi);
+}
+int fuse::fsyncdir(path_t pathname, int datasync, struct fuse_file_info *fi) {
+  return fsyncdir(detail::string(pathname), datasync, fi);
+}
+int fuse::access(path_t pathname, int mode) {
+  return access(detail::string(pathname), mode);
+}
+int fuse::create(path_t pathname, mode_t mode, struct fuse_file_info *fi) {
+  return create(detail::string(pathname), mode, fi);
+}
+int fuse::lock(path_t pathname, struct fuse_file_info *fi, int cmd,
+               struct flock *lock) {
+  return this->lock(detail::string(pathname), fi, cmd, lock);
+}
+int fuse::utimens(path_t pathname, const struct timespec tv[2],
+                  struct fuse_file_info *fi) {
+  return utimens(detail::string(pathname), tv, fi);
+}
+int fuse::bmap(path_t pathname, size_t blocksize, uint64_t *idx) {
+  return bmap(detail::string(pathname), blocksize, idx);
+}
+int fuse::ioctl(path_t pathname, int cmd, void *arg, struct fuse_file_info *fi,
+                unsigned int flags, void *data) {
+  return ioctl(detail::string(pathname), cmd, arg, fi, flags, data);
+}
+int fuse::poll(path_t pathname, struct fuse_file_info *fi,
+               struct fuse_pollhandle *ph, unsigned *reventsp) {
+  return poll(detail::string(pathname), fi, ph, reventsp);
+}
+int fuse::write_buf(path_t pathname, struct fuse_bufvec *buf, off_t off,
+                    struct fuse_file_info *fi) {
+  return write_buf(detail::string(pathname), buf, off, fi);
+}
+int fuse::read_buf(path_t pathname, struct fuse_bufvec **bufp, size_t size,
+                   off_t off, struct fuse_file_info *fi) {
+  return read_buf(detail::string(pathname), bufp, size, off, fi);
+}
+int fuse::flock(path_t pathname, struct fuse_file_info *fi, int op) {
+  return flock(detail::string(pathname), fi, op);
+}
+int fuse::fallocate(path_t pathname, int mode, off_t offset, off_t len,
+                    struct fuse_file_info *fi) {
+  return fallocate(detail::string(pathname), mode, offset, len, fi);
+}
+off_t fuse::lseek(path_t pathname, off_t off, int whence,
+                  struct fuse_file_info *fi) {
+  return lseek(detail::string(pathname), off, whence, fi);
+}
+
+fuse::handle_t::~handle_t() {}
+int fuse::handle_t::read(char *, size_t, off_t, struct fuse_file_info *) {
+  return -ENOSYS;
+}
+int fuse::handle_t::write(const char *, size_t, off_t,
+                          struct fuse_file_info *) {
+  return -ENOSYS;
+}
+int fuse::handle_t::read_buf(struct fuse_bufvec **bufp, size_t size, off_t off,
+                             struct fuse_file_info *fi) {
+  return detail::read_bufvec(bufp, size, off, detail::handle_io(*this, fi));
+}
+int fuse::handle_t::write_buf(struct fuse_bufvec *buf, off_t off,
+                              struct fuse_file_info *fi) {
+  return detail::write_bufvec(buf, off, detail::handle_io(*this, fi));
+}
+int fuse::handle_t::flush(struct fuse_file_info *) { return -ENOSYS; }
+int fuse::handle_t::fsync(int, struct fuse_file_info *) { return -ENOSYS; }
+int fuse::handle_t::readdir(off_t, struct fuse_file_info *, readdir_flags) {
+  return -ENOSYS;
+}
+int fuse::handle_t::release(struct fuse_file_info *) { return 0; }
+
+fuse::dir_handle_t::dir_handle_t() : cookie(0), pending(false) {}
+
+int fuse::dir_handle_t::readdir(off_t off, struct fuse_file_info *,
+                                readdir_flags flags) {
+  if (off != cookie) {
+    // rewinddir() or seekdir() elsewhere than where the last call stopped
+    rewind();
+    cookie = 0;
+    pending = false;
+    while (cookie < off) {
+      int result = next(name, &stbuf, (readdir_flags)0);
+      if (result <= 0) {
+        return result;
+      }
+      ++cookie;
+    }
+  }
+  fill_dir_flags fill =
+      (flags & READDIR_PLUS) ? FILL_DIR_PLUS : (fill_dir_flags)0;
+  for (;;) {
+    if (!pending) {
+      memset(&stbuf, 0, sizeof(stbuf));
+      int result = next(name, &stbuf, flags);
+      if (result <= 0) {
+        return result;
+      }
+      pending = true;
+    }
+    if (fill_dir(name.c_str(), &stbuf, cookie + 1, fill)) {
+      // buffer full, the kernel asks again from 'cookie'
+      return 0;
+    }
+    pending = false;
+    ++cookie;
+  }
+}
+
+struct fuse::writeback_t::state_t {
+  static uint64_t clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  }
+
+  size_t memory;
+  size_t extent;
+  uint64_t delay;
+
+  pthread_mutex_t lock;
+  // signalled when a handle gets dirty, when buffers run short, and
+  // when stopping
+  pthread_cond_t wake;
+  // signalled when the thread is done with a handle
+  pthread_cond_t idle;
+  pthread_t thread;
+  bool started;
+  bool stopping;
+
+  size_t buffered;
+  // handles with buffered data, and when they got it
+  std::map<writeback_handle_t *, uint64_t> dirty;
+  // the handle being written back by the thread
+  writeback_handle_t *busy;
+};
+
+struct fuse::writeback_handle_t::state_t {
+  pthread_mutex_t lock;
+  // buffered data by offset, neither overlapping nor adjacent
+  std::map<off_t, std::string> extents;
+  size_t bytes;
+  // of a write-back, not yet returned
+  int error;
+  // whose caches write-backs drop, if known
+  class fuse *fs;
+  std::string path;
+};
+
+fuse::writeback_t::writeback_t(size_t memory, size_t extent,
+                               unsigned delay_ms)
+    : state(new state_t) {
+  state->memory = memory;
+  state->extent = extent;
+  state->delay = (uint64_t)delay_ms * 1000000;
+  pthread_mutex_init(&state->lock, 0);
+  // timed waits are on the monotonic clock
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&state->wake, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_cond_init(&state->idle, 0);
+  state->stopping = false;
+  state->buffered = 0;
+  state->busy = 0;
+  state->started = pthread_create(&state->thread, 0, work, state) == 0;
+}
+
+fuse::writeback_t::~writeback_t() {
+  pthread_mutex_lock(&state->lock);
+  state->stopping = true;
+  pthread_cond_signal(&state->wake);
+  pthread_mutex_unlock(&state->lock);
+  if (state->started) {
+    pthread_join(state->thread, 0);
+  }
+  pthread_cond_destroy(&state->idle);
+  pthread_cond_destroy(&state->wake);
+  pthread_mutex_destroy(&state->lock);
+  delete state;
+}
+
+size_t fuse::writeback_t::buffered() const {
+  pthread_mutex_lock(&state->lock);
+  size_t buffered = state->buffered;
+  pthread_mutex_unlock(&state->lock);
+  return buffered;
+}
+
+void *fuse::writeback_t::work(void *arg) {
+  state_t &state = *static_cast<state_t *>(arg);
+  pthread_mutex_lock(&state.lock);
+  while (!state.stopping) {
+    // the handle dirty the longest, written back once it is due or
+    // when buffers run short
+    writeback_handle_t *handle = 0;
+    uint64_t since = 0;
+    std::map<writeback_handle_t *, uint64_t>::iterator it;
+    for (it = state.dirty.begin(); it != state.dirty.end(); ++it) {
+      if (!handle || it->second < since) {
+        handle = it->first;
+        since = it->second;
+      }
+    }
+    if (!handle) {
+      pthread_cond_wait(&state.wake, &state.lock);
+      continue;
+    }
+    uint64_t due = since + state.delay;
+    if (due > state_t::clock() && state.buffered <= state.memory / 2) {
+      struct timespec ts;
+      ts.tv_sec = due / 1000000000;
+      ts.tv_nsec = due % 1000000000;
+      pthread_cond_timedwait(&state.wake, &state.lock, &ts);
+      continue;
+    }
+
+    state.busy = handle;
+    pthread_mutex_unlock(&state.lock);
+    pthread_mutex_lock(&handle->state->lock);
+    handle->write_back_locked();
+    pthread_mutex_unlock(&handle->state->lock);
+    pthread_mutex_lock(&state.lock);
+    state.busy = 0;
+    pthread_cond_broadcast(&state.idle);
+  }
+  pthread_mutex_unlock(&state.lock);
+  return 0;
+}
+
+fuse::writeback_handle_t::writeback_handle_t(writeback_t &writeback)
+    : writeback(writeback), state(new state_t) {
+  pthread_mutex_init(&state->lock, 0);
+  state->bytes = 0;
+  state->error = 0;
+  state->fs = 0;
+}
+
+fuse::writeback_handle_t::~writeback_handle_t() {
+  writeback_t::state_t &shared = *writeback.state;
+  pthread_mutex_lock(&shared.lock);
+  while (shared.busy == this) {
+    pthread_cond_wait(&shared.idle, &shared.lock);
+  }
+  shared.dirty.erase(this);
+  shared.buffered -= state->bytes;
+  pthread_mutex_unlock(&shared.lock);
+  pthread_mutex_destroy(&state->lock);
+  delete state;
+}
+
+int fuse::writeback_handle_t::write(const char *buf, size_t count,
+                                    off_t offset, struct fuse_file_info *) {
+  writeback_t::state_t &shared = *writeback.state;
+  pthread_mutex_lock(&state->lock);
+  int result = take_error();
+  if (result || !count) {
+    pthread_mutex_unlock(&state->lock);
+    return result;
+  }
+
+  // the extent to merge into: the last one starting at or before the
+  // write, if it reaches it, or a new one
+  off_t end = offset + count;
+  std::map<off_t, std::string>::iterator it =
+      state->extents.upper_bound(offset);
+  if (it != state->extents.begin()) {
+    std::map<off_t, std::string>::iterator prev = it;
+    --prev;
+    if (prev->first + (off_t)prev->second.size() >= offset) {
+      it = prev;
+    }
+  }
+  size_t before = state->bytes;
+  if (it == state->extents.end() || it->first > offset) {
+    it = state->extents.insert(it, std::make_pair(offset, std::string()));
+  }
+  std::string &data = it->second;
+  off_t start = it->first;
+  size_t size = data.size();
+  if (start + (off_t)size < end) {
+    data.resize(end - start);
+  }
+  // and the ones after it the write reaches
+  std::map<off_t, std::string>::iterator next = it;
+  ++next;
+  while (next != state->extents.end() && next->first <= end) {
+    size_t next_size = next->second.size();
+    off_t next_end = next->first + next_size;
+    if (next_end > end) {
+      data.append(next->second, end - next->first, std::string::npos);
+    }
+    size += next_size;
+    state->extents.erase(next++);
+  }
+  data.replace(offset - start, count, buf, count);
+  state->bytes += data.size() - size;
+
+  pthread_mutex_lock(&shared.lock);
+  shared.buffered += state->bytes - before;
+  if (before == 0) {
+    shared.dirty[this] = writeback_t::state_t::clock();
+    pthread_cond_signal(&shared.wake);
+  }
+  // over the limit, this handle writes back all it buffers, while the
+  // thread writes back the others
+  bool full = shared.buffered > shared.memory;
+  if (full) {
+    pthread_cond_signal(&shared.wake);
+  }
+  pthread_mutex_unlock(&shared.lock);
+  if (full || state->bytes >= shared.extent) {
+    write_back_locked();
+    result = take_error();
+  }
+  pthread_mutex_unlock(&state->lock);
+  return result ? result : (int)count;
+}
+
+int fuse::writeback_handle_t::read(char *buf, size_t count, off_t offset,
+                                   struct fuse_file_info *) {
+  settle();
+  return read_extent(buf, count, offset);
+}
+
+int fuse::writeback_handle_t::read_buf(struct fuse_bufvec **bufp, size_t size,
+                                       off_t off, struct fuse_file_info *fi) {
+  settle();
+  return handle_t::read_buf(bufp, size, off, fi);
+}
+
+int fuse::writeback_handle_t::flush(struct fuse_file_info *) {
+  return write_back();
+}
+
+int fuse::writeback_handle_t::fsync(int, struct fuse_file_info *) {
+  return write_back();
+}
+
+int fuse::writeback_handle_t::release(struct fuse_file_info *) {
+  return write_back();
+}
+
+int fuse::writeback_handle_t::write_back() {
+  pthread_mutex_lock(&state->lock);
+  write_back_locked();
+  int result = take_error();
+  pthread_mutex_unlock(&state->lock);
+  return result;
+}
+
+void fuse::writeback_handle_t::write_back_locked() {
+  if (!state->bytes) {
+    return;
+  }
+  int error = 0;
+  std::map<off_t, std::string>::iterator it;
+  for (it = state->extents.begin(); it != state->extents.end(); ++it) {
+    const std::string &data = it->second;
+    size_t done = 0;
+    while (!error && done < data.size()) {
+      int result = write_extent(data.data() + done, data.size() - done,
+                                it->first + done);
+      if (result < 0) {
+        error = result;
+      } else if (result == 0) {
+        error = -EIO;
+      } else {
+        done += result;
+      }
+    }
+  }
+  state->extents.clear();
+  if (!state->error) {
+    state->error = error;
+  }
+  if (state->fs) {
+    // cached while the data was buffered, or before
+    detail::changed(*state->fs,
+                    state->path.empty() ? 0 : state->path.c_str(), 0, 0);
+  }
+
+  writeback_t::state_t &shared = *writeback.state;
+  pthread_mutex_lock(&shared.lock);
+  shared.buffered -= state->bytes;
+  shared.dirty.erase(this);
+  pthread_mutex_unlock(&shared.lock);
+  state->bytes = 0;
+}
+
+void fuse::writeback_handle_t::settle() {
+  // errors are left for the next write or flush
+  pthread_mutex_lock(&state->lock);
+  write_back_locked();
+  pthread_mutex_unlock(&state->lock);
+}
+
+void fuse::writeback_handle_t::track(fuse &fs, const char *pathname) {
+  pthread_mutex_lock(&state->lock);
+  state->fs = &fs;
+  // compared first, to not copy it on every write
+  if (!pathname) {
+    state->path.clear();
+  } else if (state->path != pathname) {
+    state->path = pathname;
+  }
+  pthread_mutex_unlock(&state->lock);
+}
+
+int fuse::writeback_handle_t::take_error() {
+  int error = state->error;
+  state->error = 0;
+  return error;
+}
+
+void fuse::set_handle(struct fuse_file_info *fi, handle_t *handle) {
+  fi->fh = (uintptr_t)handle;
+  detail::current_handle = handle;
+}
+
+fuse::handle_t *fuse::handle(const struct fuse_file_info *fi) {
+  handle_t *handle = detail::current_handle;
+  return fi && handle && fi->fh == (uintptr_t)handle ? handle : 0;
+}
+
+fuse::config_t::config_t()
+    : max_write(0), max_readahead(0), max_background(0),
+      congestion_threshold(0), splice_read(FLAG_DEFAULT),
+      splice_write(FLAG_DEFAULT), splice_move(FLAG_DEFAULT),
+      writeback_cache(FLAG_DEFAULT), parallel_dirops(FLAG_DEFAULT),
+      async_dio(FLAG_DEFAULT), entry_timeout(-1), attr_timeout(-1),
+      negative_timeout(-1), kernel_cache(FLAG_DEFAULT),
+      auto_cache(FLAG_DEFAULT), nullpath_ok(FLAG_DEFAULT),
+      use_ino(FLAG_DEFAULT), direct_io(FLAG_DEFAULT),
+      hard_remove(FLAG_DEFAULT), stats_path(0), cache_attr_timeout(-1),
+      cache_negative_timeout(-1), cache_size(0), read_cache_size(0),
+      read_cache_block(128 << 10), read_cache_file_limit(0),
+      read_cache_readahead(4) {}
+
+void fuse::stats(stats_t &stats) {
+  memset(&stats, 0, sizeof(stats));
+#ifdef FUSEXX_STATS
+  pthread_mutex_lock(&detail::shards_lock);
+  for (detail::shard *shard = detail::shards; shard; shard = shard->next) {
+    for (int op = 0; op < OP_COUNT; ++op) {
+      const op_stats_t &from = shard->ops[op];
+      op_stats_t &to = stats.ops[op];
+      to.count += __atomic_load_n(&from.count, __ATOMIC_RELAXED);
+      to.errors += __atomic_load_n(&from.errors, __ATOMIC_RELAXED);
+      to.bytes += __atomic_load_n(&from.bytes, __ATOMIC_RELAXED);
+      to.nanoseconds += __atomic_load_n(&from.nanoseconds, __ATOMIC_RELAXED);
+      for (int bucket = 0; bucket < latency_buckets; ++bucket) {
+        to.latency[bucket] +=
+            __atomic_load_n(&from.latency[bucket], __ATOMIC_RELAXED);
+      }
+    }
+  }
+  pthread_mutex_unlock(&detail::shards_lock);
+#endif
+}
+
+const char *fuse::op_name(operation op) {
+  static const char *const names[OP_COUNT] = {
+      "getattr",  "readlink",   "mknod",      "mkdir",    "unlink",
+      "rmdir",    "symlink",    "rename",     "link",     "chmod",
+      "chown",    "truncate",   "open",       "read",     "write",
+      "statfs",   "flush",      "release",    "fsync",    "setxattr",
+      "getxattr", "listxattr",  "removexattr", "opendir", "readdir",
+      "releasedir", "fsyncdir", "access",     "create",   "lock",
+      "utimens",  "bmap",       "ioctl",      "poll",     "write_buf",
+      "read_buf", "flock",      "fallocate",   "lseek"};
+  return op >= 0 && op < OP_COUNT ? names[op] : "unknown";
+}
+
+std::string fuse::stats_text() {
+  stats_t all;
+  stats(all);
+  std::string text;
+  char field[80];
+  for (int op = 0; op < OP_COUNT; ++op) {
+    const op_stats_t &stats = all.ops[op];
+    if (!stats.count) {
+      continue;
+    }
+    snprintf(field, sizeof(field), "%s count %llu errors %llu bytes %llu",
+             op_name((operation)op), (unsigned long long)stats.count,
+             (unsigned long long)stats.errors,
+             (unsigned long long)stats.bytes);
+    text += field;
+    snprintf(field, sizeof(field), " avg_ns %llu latency_ns",
+             (unsigned long long)(stats.nanoseconds / stats.count));
+    text += field;
+    // each bucket is printed as its upper bound in ns and its count
+    for (int bucket = 0; bucket < latency_buckets; ++bucket) {
+      if (stats.latency[bucket]) {
+        snprintf(field, sizeof(field), " <%llu:%llu", 1ULL << (bucket + 1),
+                 (unsigned long long)stats.latency[bucket]);
+        text += field;
+      }
+    }
+    text += '\n';
+  }
+  return text;
+}
+
+fuse::fuse() : cache(new attr_cache), blocks(new read_cache), renames(0) {}
+
+void fuse::cache_stats(cache_stats_t &stats) const { cache->stats(stats); }
+
+void fuse::read_cache_stats(read_cache_stats_t &stats) const {
+  blocks->stats(stats);
+}
+
+void fuse::cache_invalidate(path_t pathname, bool tree) {
+  std::string path = pathname.str();
+  cache->changed(path.c_str(), tree ? attr_cache::TREE : 0);
+  blocks->changed(path.c_str(), tree);
+}
+
+void fuse::cache_clear() {
+  cache->changed(0, 0);
+  blocks->changed(0, false);
+}
+
+const fuse::context_t &fuse::context() { return detail::request_context; }
+
+void *fuse::scratch(size_t size) {
+  detail::arena &memory = detail::arena::get();
+  return memory.depth ? memory.allocate(size) : 0;
+}
+
+bool fuse::context_t::interrupted() const {
+#if FUSE_VERSION >= 28
+  return fuse_interrupted();
+#else
+  return false;
+#endif
+}
+
+const struct fuse_operations &fuse::operations() {
+  static const struct fuse_operations ops = {
     .getattr = fuse::detail::getattr,
     .readlink = fuse::detail::readlink,
 #if FUSE_VERSION < 30
@@ -487,8 +2936,8 @@ int fuse::main(int argc, char *argv[]) {
     .access = fuse::detail::access,
     .create = fuse::detail::create,
 #if FUSE_VERSION < 30
-    .ftruncate = 0,
-    .fgetattr = 0,
+    .ftruncate = fuse::detail::ftruncate,
+    .fgetattr = fuse::detail::fgetattr,
 #endif // FUSE_VERSION < 30
 #endif // FUSE_VERSION >= 25
 #if FUSE_VERSION >= 26
@@ -511,24 +2960,92 @@ int fuse::main(int argc, char *argv[]) {
 
     .ioctl = fuse::detail::ioctl,
     .poll = fuse::detail::poll,
-    .write_buf = 0, // fuse::detail::write_buf,
-    .read_buf = 0,  // fuse::detail::read_buf,
+    .write_buf = fuse::detail::write_buf,
+    .read_buf = fuse::detail::read_buf,
     .flock = fuse::detail::flock,
     .fallocate = fuse::detail::fallocate,
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+    .lseek = fuse::detail::lseek,
+#endif
 #endif
   };
+  return ops;
+}
+
+int fuse::main(int argc, char *argv[]) {
+#if FUSE_VERSION >= 30
+  // fuse_main() with the multi-threaded loop run by loop_config
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  struct fuse_cmdline_opts opts;
+  struct fuse *f;
+  int ret = 1;
+
+  if (fuse_parse_cmdline(&args, &opts) != 0) {
+    fuse_opt_free_args(&args);
+    return 1;
+  }
+  if (opts.show_version) {
+    printf("FUSE library version %s\n", fuse_pkgversion());
+    fuse_lowlevel_version();
+    ret = 0;
+  } else if (opts.show_help) {
+    printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
+    fuse_cmdline_help();
+    fuse_lib_help(&args);
+    ret = 0;
+  } else if (!opts.mountpoint) {
+    fprintf(stderr, "error: no mountpoint specified\n");
+  } else {
+    if (opts.clone_fd) {
+      loop_config.clone_fd = true;
+    }
+#if FUSE_USE_VERSION >= 32
+    if (!loop_config.max_idle_threads) {
+      loop_config.max_idle_threads = opts.max_idle_threads;
+    }
+#endif
+    if ((opts.singlethread || loop_config.valid()) &&
+        (f = fuse_new(&args, &operations(), sizeof(struct fuse_operations),
+                      this))) {
+      if (fuse_mount(f, opts.mountpoint) == 0) {
+        if (fuse_daemonize(opts.foreground) == 0 &&
+            fuse_set_signal_handlers(fuse_get_session(f)) == 0) {
+          if (opts.singlethread) {
+            ret = fuse_loop(f);
+          } else if (fuse_start_cleanup_thread(f) == 0) {
+            ret = fuse_lowlevel::loop_mt(fuse_get_session(f), loop_config);
+            fuse_stop_cleanup_thread(f);
+          }
+          ret = ret ? 1 : 0;
+          fuse_remove_signal_handlers(fuse_get_session(f));
+        }
+        fuse_unmount(f);
+      }
+      fuse_destroy(f);
+    }
+  }
+
+  free(opts.mountpoint);
+  fuse_opt_free_args(&args);
+  return ret;
+#else
+  int ret;
 
 #if FUSE_VERSION < 23
   init()
 #endif
 
-      ret = fuse_main(argc, argv, &ops, this);
+      ret = fuse_main(argc, argv, &operations(), this);
 
 #if FUSE_VERSION < 23
   destroy()
 #endif
 
       return ret;
+#endif
 }
 
-fuse::~fuse() {}
+fuse::~fuse() {
+  delete blocks;
+  delete cache;
+}
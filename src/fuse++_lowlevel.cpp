@@ -0,0 +1,1357 @@
+#include <fuse++_lowlevel>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 30
+#endif
+
+#include <fuse_lowlevel.h>
+
+#if FUSE_VERSION < 30
+#warning fuse_lowlevel requires libfuse 3
+#else // FUSE_VERSION < 30
+
+/* requests deferred through req_t::defer() */
+
+struct fuse_lowlevel::deferrals_t {
+  deferrals_t() : executor(0), limit(0), count(0) {
+    pthread_mutex_init(&lock, 0);
+    pthread_cond_init(&replied, 0);
+  }
+  ~deferrals_t() {
+    pthread_cond_destroy(&replied);
+    pthread_mutex_destroy(&lock);
+  }
+
+  pthread_mutex_t lock;
+  // signalled as each one is replied to
+  pthread_cond_t replied;
+  // changed atomically
+  executor_t *executor;
+  size_t limit;
+  // changed under the lock, read atomically
+  size_t count;
+  std::set<fuse_req_t> reqs;
+};
+
+/* notifications, see queue_inval_inode() and notify_retrieve() */
+
+struct fuse_lowlevel::notifications_t {
+  typedef std::function<void(off_t, struct fuse_bufvec *)> retrieve_t;
+  // offset and length to invalidate, by inode
+  typedef std::map<uint64_t, std::pair<off_t, off_t> > inodes_t;
+  typedef std::set<std::pair<uint64_t, std::string> > entries_t;
+
+  notifications_t() : started(false), stopping(false), sending(false) {
+    pthread_mutex_init(&lock, 0);
+    pthread_cond_init(&queued, 0);
+    pthread_cond_init(&sent, 0);
+  }
+  ~notifications_t() {
+    for (std::set<retrieve_t *>::iterator it = retrieves.begin();
+         it != retrieves.end(); ++it) {
+      delete *it;
+    }
+    pthread_cond_destroy(&sent);
+    pthread_cond_destroy(&queued);
+    pthread_mutex_destroy(&lock);
+  }
+
+  pthread_mutex_t lock;
+
+  // the callbacks of retrieves not yet replied to
+  std::set<retrieve_t *> retrieves;
+
+  // the invalidations not yet sent
+  inodes_t inodes;
+  entries_t entries;
+  // signalled when there are some, or when stopping
+  pthread_cond_t queued;
+  // signalled after each batch
+  pthread_cond_t sent;
+  pthread_t thread;
+  bool started;
+  bool stopping;
+  bool sending;
+};
+
+class fuse_lowlevel::detail {
+public:
+  static class fuse_lowlevel &fuse(fuse_req_t req) {
+    return *static_cast<class fuse_lowlevel *>(fuse_req_userdata(req));
+  }
+
+  /* interrupt callbacks registered through req_t::interrupt_func */
+
+  static pthread_mutex_t interrupts_lock;
+  static std::map<fuse_req_t, std::function<void()> > interrupts;
+  static size_t interrupts_count;
+
+  // Called by libfuse with the request's lock held, so interrupts_lock
+  // must never be held while calling into libfuse for a request.
+  static void interrupt(fuse_req_t req, void *) {
+    std::function<void()> func;
+    pthread_mutex_lock(&interrupts_lock);
+    std::map<fuse_req_t, std::function<void()> >::iterator it =
+        interrupts.find(req);
+    if (it != interrupts.end()) {
+      func = it->second;
+    }
+    pthread_mutex_unlock(&interrupts_lock);
+    // without interrupts_lock, as the callback may well reply
+    if (func) {
+      func();
+    }
+  }
+
+  // must be held over every reply, the request being freed by the reply
+  class replying {
+  public:
+    replying(fuse_req_t req) : deferrals(0) {
+      // libfuse clears its own callback when the reply frees the request;
+      // one arriving before that finds nothing to call
+      if (__atomic_load_n(&interrupts_count, __ATOMIC_RELAXED) != 0) {
+        pthread_mutex_lock(&interrupts_lock);
+        if (interrupts.erase(req)) {
+          __atomic_sub_fetch(&interrupts_count, 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&interrupts_lock);
+      }
+
+      deferrals_t &deferred = *fuse(req).deferrals;
+      if (__atomic_load_n(&deferred.count, __ATOMIC_ACQUIRE) == 0) {
+        return;
+      }
+      pthread_mutex_lock(&deferred.lock);
+      if (deferred.reqs.erase(req)) {
+        deferrals = &deferred;
+      }
+      pthread_mutex_unlock(&deferred.lock);
+    }
+
+    // counted until the reply is sent, for drain()
+    ~replying() {
+      if (deferrals) {
+        pthread_mutex_lock(&deferrals->lock);
+        __atomic_store_n(&deferrals->count, deferrals->count - 1,
+                         __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&deferrals->replied);
+        pthread_mutex_unlock(&deferrals->lock);
+      }
+    }
+
+  private:
+    deferrals_t *deferrals;
+  };
+
+  // run a task on a thread of its own, when there is no executor
+  static void *run(void *arg) {
+    std::function<void()> *task = static_cast<std::function<void()> *>(arg);
+    (*task)();
+    delete task;
+    return 0;
+  }
+  static void spawn(const std::function<void()> &task) {
+    std::function<void()> *arg = new std::function<void()>(task);
+    pthread_attr_t attr;
+    pthread_t thread;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&thread, &attr, run, arg);
+    pthread_attr_destroy(&attr);
+    if (err) {
+      // out of threads, so this one it is
+      run(arg);
+    }
+  }
+
+  /* queued invalidations */
+
+  // widen a queued range to cover another one as well
+  static void merge(std::pair<off_t, off_t> &range, off_t off, off_t len) {
+    if (off < 0) {
+      // attributes only, which any invalidation covers
+      return;
+    }
+    if (range.first < 0) {
+      range = std::make_pair(off, len);
+      return;
+    }
+    off_t start = std::min(range.first, off);
+    if (range.second == 0 || len == 0) {
+      range = std::make_pair(start, (off_t)0);
+    } else {
+      off_t end = std::max(range.first + range.second, off + len);
+      range = std::make_pair(start, end - start);
+    }
+  }
+
+  // send what is queued, with the lock held; false if nothing was
+  static bool send_invals(class fuse_lowlevel &fs) {
+    notifications_t &n = *fs.notifications;
+    if (n.inodes.empty() && n.entries.empty()) {
+      return false;
+    }
+    notifications_t::inodes_t inodes;
+    notifications_t::entries_t entries;
+    inodes.swap(n.inodes);
+    entries.swap(n.entries);
+    n.sending = true;
+    pthread_mutex_unlock(&n.lock);
+
+    // failures are expected, for what the kernel no longer caches
+    for (notifications_t::entries_t::iterator it = entries.begin();
+         it != entries.end(); ++it) {
+      fuse_lowlevel_notify_inval_entry(fs.session, it->first,
+                                       it->second.c_str(), it->second.size());
+    }
+    for (notifications_t::inodes_t::iterator it = inodes.begin();
+         it != inodes.end(); ++it) {
+      fuse_lowlevel_notify_inval_inode(fs.session, it->first, it->second.first,
+                                       it->second.second);
+    }
+
+    pthread_mutex_lock(&n.lock);
+    n.sending = false;
+    pthread_cond_broadcast(&n.sent);
+    return true;
+  }
+
+  static void *invals_thread(void *arg) {
+    class fuse_lowlevel &fs = *static_cast<class fuse_lowlevel *>(arg);
+    notifications_t &n = *fs.notifications;
+    pthread_mutex_lock(&n.lock);
+    while (send_invals(fs) || !n.stopping) {
+      if (n.inodes.empty() && n.entries.empty() && !n.stopping) {
+        pthread_cond_wait(&n.queued, &n.lock);
+      }
+    }
+    pthread_mutex_unlock(&n.lock);
+    return 0;
+  }
+
+  // after queueing, with the lock held
+  static void queued(class fuse_lowlevel &fs) {
+    notifications_t &n = *fs.notifications;
+    if (!n.started) {
+      n.started = pthread_create(&n.thread, 0, invals_thread, &fs) == 0;
+    }
+    if (n.started) {
+      pthread_cond_signal(&n.queued);
+    } else {
+      // out of threads, so this one it is
+      send_invals(fs);
+    }
+  }
+
+  /* the multi-threaded loop with reading threads of our own */
+
+  struct readers_t {
+    const loop_config_t *config;
+    struct fuse_session *session;
+    // posted by a reader as it stops
+    sem_t finish;
+    bool failed;
+    // requests handed to the executor and not yet processed
+    pthread_mutex_t lock;
+    pthread_cond_t processed;
+    size_t queued;
+  };
+
+  struct reader_t {
+    readers_t *readers;
+    size_t index;
+    pthread_t thread;
+    struct fuse_buf buf;
+  };
+
+  static void process(readers_t *readers, struct fuse_buf buf) {
+    fuse_session_process_buf(readers->session, &buf);
+    free(buf.mem);
+    pthread_mutex_lock(&readers->lock);
+    if (--readers->queued == 0) {
+      pthread_cond_broadcast(&readers->processed);
+    }
+    pthread_mutex_unlock(&readers->lock);
+  }
+
+  static void *read_requests(void *arg) {
+    reader_t *reader = static_cast<reader_t *>(arg);
+    readers_t *readers = reader->readers;
+    const loop_config_t &config = *readers->config;
+
+    if (!config.cpus.empty()) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(config.cpus[reader->index % config.cpus.size()], &cpus);
+      pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+
+    // cancelled by the loop only while waiting for a request
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, 0);
+    while (!fuse_session_exited(readers->session)) {
+      pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, 0);
+      int res = fuse_session_receive_buf(readers->session, &reader->buf);
+      pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, 0);
+      if (res == -EINTR) {
+        continue;
+      }
+      if (res <= 0) {
+        if (res < 0) {
+          readers->failed = true;
+        }
+        fuse_session_exit(readers->session);
+        break;
+      }
+
+      // spliced requests are in this thread's pipe, so stay here
+      if (!config.executor || (reader->buf.flags & FUSE_BUF_IS_FD)) {
+        fuse_session_process_buf(readers->session, &reader->buf);
+        continue;
+      }
+      struct fuse_buf buf = reader->buf;
+      buf.size = res;
+      buf.mem = malloc(res);
+      if (!buf.mem) {
+        fuse_session_process_buf(readers->session, &reader->buf);
+        continue;
+      }
+      memcpy(buf.mem, reader->buf.mem, res);
+      pthread_mutex_lock(&readers->lock);
+      ++readers->queued;
+      pthread_mutex_unlock(&readers->lock);
+      config.executor->submit(std::bind(process, readers, buf));
+    }
+    sem_post(&readers->finish);
+    return 0;
+  }
+
+  static int loop_readers(struct fuse_session *session,
+                          const loop_config_t &config) {
+    size_t count = config.threads;
+    if (!count) {
+      count = config.cpus.empty() ? 1 : config.cpus.size();
+    }
+
+    readers_t readers;
+    readers.config = &config;
+    readers.session = session;
+    sem_init(&readers.finish, 0, 0);
+    readers.failed = false;
+    pthread_mutex_init(&readers.lock, 0);
+    pthread_cond_init(&readers.processed, 0);
+    readers.queued = 0;
+
+    std::vector<reader_t> reader(count);
+    size_t started = 0;
+    for (; started < count; ++started) {
+      reader[started].readers = &readers;
+      reader[started].index = started;
+      memset(&reader[started].buf, 0, sizeof(reader[started].buf));
+      if (pthread_create(&reader[started].thread, 0, read_requests,
+                         &reader[started]) != 0) {
+        readers.failed = true;
+        fuse_session_exit(session);
+        break;
+      }
+    }
+
+    while (!fuse_session_exited(session)) {
+      sem_wait(&readers.finish);
+    }
+    for (size_t i = 0; i < started; ++i) {
+      pthread_cancel(reader[i].thread);
+    }
+    for (size_t i = 0; i < started; ++i) {
+      pthread_join(reader[i].thread, 0);
+      free(reader[i].buf.mem);
+    }
+
+    pthread_mutex_lock(&readers.lock);
+    while (readers.queued) {
+      pthread_cond_wait(&readers.processed, &readers.lock);
+    }
+    pthread_mutex_unlock(&readers.lock);
+
+    pthread_cond_destroy(&readers.processed);
+    pthread_mutex_destroy(&readers.lock);
+    sem_destroy(&readers.finish);
+    return readers.failed ? -1 : 0;
+  }
+
+  /* operations */
+
+  static void init(void *userdata, struct fuse_conn_info *conn) {
+    conn->want &= ~(FUSE_CAP_POSIX_LOCKS | FUSE_CAP_FLOCK_LOCKS |
+                    FUSE_CAP_READDIRPLUS | FUSE_CAP_READDIRPLUS_AUTO);
+    static_cast<class fuse_lowlevel *>(userdata)->init(conn);
+  }
+  static void destroy(void *userdata) {
+    static_cast<class fuse_lowlevel *>(userdata)->destroy();
+  }
+  static void lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    fuse(req).lookup(req, parent, name);
+  }
+  static void forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+    fuse(req).forget(req, ino, nlookup);
+  }
+  static void getattr(fuse_req_t req, fuse_ino_t ino,
+                      struct fuse_file_info *fi) {
+    fuse(req).getattr(req, ino, fi);
+  }
+  static void setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                      int to_set, struct fuse_file_info *fi) {
+    fuse(req).setattr(req, ino, attr, to_set, fi);
+  }
+  static void readlink(fuse_req_t req, fuse_ino_t ino) {
+    fuse(req).readlink(req, ino);
+  }
+  static void mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                    mode_t mode, dev_t rdev) {
+    fuse(req).mknod(req, parent, name, mode, rdev);
+  }
+  static void mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                    mode_t mode) {
+    fuse(req).mkdir(req, parent, name, mode);
+  }
+  static void unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    fuse(req).unlink(req, parent, name);
+  }
+  static void rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    fuse(req).rmdir(req, parent, name);
+  }
+  static void symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+                      const char *name) {
+    fuse(req).symlink(req, link, parent, name);
+  }
+  static void rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                     fuse_ino_t newparent, const char *newname,
+                     unsigned int flags) {
+    fuse(req).rename(req, parent, name, newparent, newname, flags);
+  }
+  static void link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                   const char *newname) {
+    fuse(req).link(req, ino, newparent, newname);
+  }
+  static void open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    fuse(req).open(req, ino, fi);
+  }
+  static void read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                   struct fuse_file_info *fi) {
+    fuse(req).read(req, ino, size, off, fi);
+  }
+  static void write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                    size_t size, off_t off, struct fuse_file_info *fi) {
+    fuse(req).write(req, ino, buf, size, off, fi);
+  }
+  static void flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    fuse(req).flush(req, ino, fi);
+  }
+  static void release(fuse_req_t req, fuse_ino_t ino,
+                      struct fuse_file_info *fi) {
+    fuse(req).release(req, ino, fi);
+  }
+  static void fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                    struct fuse_file_info *fi) {
+    fuse(req).fsync(req, ino, datasync, fi);
+  }
+  static void opendir(fuse_req_t req, fuse_ino_t ino,
+                      struct fuse_file_info *fi) {
+    fuse(req).opendir(req, ino, fi);
+  }
+  static void readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                      struct fuse_file_info *fi) {
+    fuse(req).readdir(req, ino, size, off, fi);
+  }
+  static void releasedir(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_file_info *fi) {
+    fuse(req).releasedir(req, ino, fi);
+  }
+  static void fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+                       struct fuse_file_info *fi) {
+    fuse(req).fsyncdir(req, ino, datasync, fi);
+  }
+  static void statfs(fuse_req_t req, fuse_ino_t ino) {
+    fuse(req).statfs(req, ino);
+  }
+  static void setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                       const char *value, size_t size, int flags) {
+    fuse(req).setxattr(req, ino, name, value, size, flags);
+  }
+  static void getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                       size_t size) {
+    fuse(req).getxattr(req, ino, name, size);
+  }
+  static void listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+    fuse(req).listxattr(req, ino, size);
+  }
+  static void removexattr(fuse_req_t req, fuse_ino_t ino, const char *name) {
+    fuse(req).removexattr(req, ino, name);
+  }
+  static void access(fuse_req_t req, fuse_ino_t ino, int mask) {
+    fuse(req).access(req, ino, mask);
+  }
+  static void create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                     mode_t mode, struct fuse_file_info *fi) {
+    fuse(req).create(req, parent, name, mode, fi);
+  }
+  static void getlk(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi,
+                    struct flock *lock) {
+    fuse(req).getlk(req, ino, fi, lock);
+  }
+  static void setlk(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi,
+                    struct flock *lock, int sleep) {
+    fuse(req).setlk(req, ino, fi, lock, sleep);
+  }
+  static void bmap(fuse_req_t req, fuse_ino_t ino, size_t blocksize,
+                   uint64_t idx) {
+    fuse(req).bmap(req, ino, blocksize, idx);
+  }
+#if FUSE_USE_VERSION < 35
+  static void ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
+                    struct fuse_file_info *fi, unsigned flags,
+                    const void *in_buf, size_t in_bufsz, size_t out_bufsz) {
+#else  // FUSE_USE_VERSION < 35
+  static void ioctl(fuse_req_t req, fuse_ino_t ino, unsigned int cmd, void *arg,
+                    struct fuse_file_info *fi, unsigned flags,
+                    const void *in_buf, size_t in_bufsz, size_t out_bufsz) {
+#endif
+    fuse(req).ioctl(req, ino, cmd, arg, fi, flags, in_buf, in_bufsz,
+                    out_bufsz);
+  }
+  static void poll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi,
+                   struct fuse_pollhandle *ph) {
+    fuse(req).poll(req, ino, fi, ph);
+  }
+  static void write_buf(fuse_req_t req, fuse_ino_t ino,
+                        struct fuse_bufvec *bufv, off_t off,
+                        struct fuse_file_info *fi) {
+    fuse(req).write_buf(req, ino, bufv, off, fi);
+  }
+  static void retrieve_reply(fuse_req_t req, void *cookie, fuse_ino_t ino,
+                             off_t offset, struct fuse_bufvec *bufv) {
+    fuse(req).retrieve_reply(req, cookie, ino, offset, bufv);
+  }
+  static void forget_multi(fuse_req_t req, size_t count,
+                           struct fuse_forget_data *forgets) {
+    fuse(req).forget_multi(req, count, forgets);
+  }
+  static void flock(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi,
+                    int op) {
+    fuse(req).flock(req, ino, fi, op);
+  }
+  static void fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+                        off_t length, struct fuse_file_info *fi) {
+    fuse(req).fallocate(req, ino, mode, offset, length, fi);
+  }
+  static void readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+                          off_t off, struct fuse_file_info *fi) {
+    fuse(req).readdirplus(req, ino, size, off, fi);
+  }
+
+  static const struct fuse_lowlevel_ops &operations() {
+    static struct fuse_lowlevel_ops ops;
+    static bool filled = false;
+    if (!filled) {
+      memset(&ops, 0, sizeof(ops));
+      ops.init = detail::init;
+      ops.destroy = detail::destroy;
+      ops.lookup = detail::lookup;
+      ops.forget = detail::forget;
+      ops.getattr = detail::getattr;
+      ops.setattr = detail::setattr;
+      ops.readlink = detail::readlink;
+      ops.mknod = detail::mknod;
+      ops.mkdir = detail::mkdir;
+      ops.unlink = detail::unlink;
+      ops.rmdir = detail::rmdir;
+      ops.symlink = detail::symlink;
+      ops.rename = detail::rename;
+      ops.link = detail::link;
+      ops.open = detail::open;
+      ops.read = detail::read;
+      ops.write = detail::write;
+      ops.flush = detail::flush;
+      ops.release = detail::release;
+      ops.fsync = detail::fsync;
+      ops.opendir = detail::opendir;
+      ops.readdir = detail::readdir;
+      ops.releasedir = detail::releasedir;
+      ops.fsyncdir = detail::fsyncdir;
+      ops.statfs = detail::statfs;
+      ops.setxattr = detail::setxattr;
+      ops.getxattr = detail::getxattr;
+      ops.listxattr = detail::listxattr;
+      ops.removexattr = detail::removexattr;
+      ops.access = detail::access;
+      ops.create = detail::create;
+      ops.getlk = detail::getlk;
+      ops.setlk = detail::setlk;
+      ops.bmap = detail::bmap;
+      ops.ioctl = detail::ioctl;
+      ops.poll = detail::poll;
+      ops.write_buf = detail::write_buf;
+      ops.retrieve_reply = detail::retrieve_reply;
+      ops.forget_multi = detail::forget_multi;
+      ops.flock = detail::flock;
+      ops.fallocate = detail::fallocate;
+      ops.readdirplus = detail::readdirplus;
+      filled = true;
+    }
+    return ops;
+  }
+};
+
+pthread_mutex_t fuse_lowlevel::detail::interrupts_lock =
+    PTHREAD_MUTEX_INITIALIZER;
+std::map<fuse_req_t, std::function<void()> >
+    fuse_lowlevel::detail::interrupts;
+size_t fuse_lowlevel::detail::interrupts_count = 0;
+
+/* reply data in pieces */
+
+fuse_lowlevel::segments_t::segments_t() : bytes(0) {}
+
+fuse_lowlevel::segments_t::~segments_t() { clear(); }
+
+void fuse_lowlevel::segments_t::add(const void *data, size_t size,
+                                    std::function<void()> release) {
+  struct iovec *last = pieces.empty() ? 0 : &pieces.back();
+  if (last && (const char *)last->iov_base + last->iov_len == data) {
+    // one piece fewer for the IOV_MAX limit
+    last->iov_len += size;
+  } else {
+    struct iovec piece;
+    piece.iov_base = const_cast<void *>(data);
+    piece.iov_len = size;
+    pieces.push_back(piece);
+  }
+  if (release) {
+    releases.push_back(release);
+  }
+  bytes += size;
+}
+
+size_t fuse_lowlevel::segments_t::size() const { return bytes; }
+
+size_t fuse_lowlevel::segments_t::count() const { return pieces.size(); }
+
+void fuse_lowlevel::segments_t::clear() {
+  for (size_t i = 0; i < releases.size(); ++i) {
+    releases[i]();
+  }
+  pieces.clear();
+  releases.clear();
+  bytes = 0;
+}
+
+/* requests */
+
+fuse_lowlevel::req_t::req_t(struct fuse_req *req) : fuse_req(req) {}
+
+int fuse_lowlevel::req_t::reply_err(int err) {
+  detail::replying replying(fuse_req);
+  return fuse_reply_err(fuse_req, err);
+}
+void fuse_lowlevel::req_t::reply_none() {
+  if (fuse_req) {
+    detail::replying replying(fuse_req);
+    fuse_reply_none(fuse_req);
+  }
+}
+int fuse_lowlevel::req_t::reply_entry(const struct fuse_entry_param *e) {
+  detail::replying replying(fuse_req);
+  return fuse_reply_entry(fuse_req, e);
+}
+int fuse_lowlevel::req_t::reply_create(const struct fuse_entry_param *e,
+                                       const struct fuse_file_info *fi) {
+  detail::replying replying(fuse_req);
+  return fuse_reply_create(fuse_req, e, fi);
+}
+int fuse_lowlevel::req_t::reply_attr(const struct stat *attr,
+                                     double attr_timeout) {
+  detail::replying replying(fuse_req);
+  return fuse_reply_attr(fuse_req, attr, attr_timeout);
+}
+int fuse_lowlevel::req_t::reply_readlink(const char *link) {
+  detail::replying replying(fuse_req);
+  return fuse_reply_readlink(fuse_req, link);
+}
+int fuse_lowlevel::req_t::reply_open(const struct fuse_file_info *fi) {
+  detail::replying replying(fuse_req);
+  return fuse_reply_open(fuse_req, fi);
+}
+int fuse_lowlevel::req_t::reply_write(size_t count) {
+  detail::replying replying(fuse_req);
+  return fuse_reply_write(fuse_req, count);
+}
+int fuse_lowlevel::req_t::reply_buf(const char *buf, size_t size) {
+  detail::replying replying(fuse_req);
+  return fuse_reply_buf(fuse_req, buf, size);
+}
+int fuse_lowlevel::req_t::reply_data(struct fuse_bufvec *bufv, int flags) {
+  detail::replying replying(fuse_req);
+  return fuse_reply_data(fuse_req, bufv, (enum fuse_buf_copy_flags)flags);
+}
+int fuse_lowlevel::req_t::reply_iov(const struct iovec *iov, int count) {
+  detail::replying replying(fuse_req);
+  return fuse_reply_iov(fuse_req, iov, count);
+}
+int fuse_lowlevel::req_t::reply_segments(segments_t &segments) {
+  int result;
+  size_t count = segments.pieces.size();
+  // libfuse adds the header to the vector
+  if (count < IOV_MAX) {
+    detail::replying replying(fuse_req);
+    result = fuse_reply_iov(fuse_req, count ? &segments.pieces[0] : 0, count);
+  } else {
+    struct fuse_bufvec *bufv = (struct fuse_bufvec *)calloc(
+        1, sizeof(struct fuse_bufvec) + (count - 1) * sizeof(struct fuse_buf));
+    if (!bufv) {
+      segments.clear();
+      return reply_err(ENOMEM);
+    }
+    bufv->count = count;
+    for (size_t i = 0; i < count; ++i) {
+      bufv->buf[i].mem = segments.pieces[i].iov_base;
+      bufv->buf[i].size = segments.pieces[i].iov_len;
+      bufv->buf[i].fd = -1;
+    }
+    {
+      detail::replying replying(fuse_req);
+      result = fuse_reply_data(fuse_req, bufv, (enum fuse_buf_copy_flags)0);
+    }
+    free(bufv);
+  }
+  segments.clear();
+  return result;
+}
+int fuse_lowlevel::req_t::reply_statfs(const struct statvfs *stbuf) {
+  detail::replying replying(fuse_req);
+  return fuse_reply_statfs(fuse_req, stbuf);
+}
+int fuse_lowlevel::req_t::reply_xattr(size_t count) {
+  detail::replying replying(fuse_req);
+  return fuse_reply_xattr(fuse_req, count);
+}
+int fuse_lowlevel::req_t::reply_lock(const struct flock *lock) {
+  detail::replying replying(fuse_req);
+  return fuse_reply_lock(fuse_req, lock);
+}
+int fuse_lowlevel::req_t::reply_bmap(uint64_t idx) {
+  detail::replying replying(fuse_req);
+  return fuse_reply_bmap(fuse_req, idx);
+}
+size_t fuse_lowlevel::req_t::add_direntry(char *buf, size_t bufsize,
+                                          const char *name,
+                                          const struct stat *stbuf, off_t off) {
+  return fuse_add_direntry(fuse_req, buf, bufsize, name, stbuf, off);
+}
+size_t fuse_lowlevel::req_t::add_direntry_plus(char *buf, size_t bufsize,
+                                               const char *name,
+                                               const struct fuse_entry_param *e,
+                                               off_t off) {
+  return fuse_add_direntry_plus(fuse_req, buf, bufsize, name, e, off);
+}
+int fuse_lowlevel::req_t::reply_ioctl_retry(const struct iovec *in_iov,
+                                            size_t in_count,
+                                            const struct iovec *out_iov,
+                                            size_t out_count) {
+  detail::replying replying(fuse_req);
+  return fuse_reply_ioctl_retry(fuse_req, in_iov, in_count, out_iov, out_count);
+}
+int fuse_lowlevel::req_t::reply_ioctl(int result, const void *buf,
+                                      size_t size) {
+  detail::replying replying(fuse_req);
+  return fuse_reply_ioctl(fuse_req, result, buf, size);
+}
+int fuse_lowlevel::req_t::reply_ioctl_iov(int result, const struct iovec *iov,
+                                          int count) {
+  detail::replying replying(fuse_req);
+  return fuse_reply_ioctl_iov(fuse_req, result, iov, count);
+}
+int fuse_lowlevel::req_t::reply_poll(unsigned revents) {
+  detail::replying replying(fuse_req);
+  return fuse_reply_poll(fuse_req, revents);
+}
+
+fuse_lowlevel &fuse_lowlevel::req_t::fuse() { return detail::fuse(fuse_req); }
+
+int fuse_lowlevel::req_t::getgroups(int size, gid_t list[]) {
+  return fuse_req_getgroups(fuse_req, size, list);
+}
+
+void fuse_lowlevel::req_t::interrupt_func(std::function<void()> func) {
+  pthread_mutex_lock(&detail::interrupts_lock);
+  if (func) {
+    std::function<void()> &slot = detail::interrupts[fuse_req];
+    if (!slot) {
+      __atomic_add_fetch(&detail::interrupts_count, 1, __ATOMIC_RELAXED);
+    }
+    slot = func;
+  } else if (detail::interrupts.erase(fuse_req)) {
+    __atomic_sub_fetch(&detail::interrupts_count, 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&detail::interrupts_lock);
+  // libfuse calls back immediately if the request is already interrupted,
+  // so this must come after unlocking
+  if (func) {
+    fuse_req_interrupt_func(fuse_req, detail::interrupt, 0);
+  } else {
+    fuse_req_interrupt_func(fuse_req, 0, 0);
+  }
+}
+
+void fuse_lowlevel::req_t::defer() {
+  deferrals_t &deferrals = *fuse().deferrals;
+  pthread_mutex_lock(&deferrals.lock);
+  while (deferrals.limit && deferrals.count >= deferrals.limit) {
+    pthread_cond_wait(&deferrals.replied, &deferrals.lock);
+  }
+  if (deferrals.reqs.insert(fuse_req).second) {
+    __atomic_store_n(&deferrals.count, deferrals.count + 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&deferrals.lock);
+}
+
+void fuse_lowlevel::req_t::defer(std::function<void(req_t)> task) {
+  defer();
+  req_t req(*this);
+  std::function<void()> run = [req, task]() mutable {
+    if (req.interrupted()) {
+      req.reply_err(EINTR);
+    } else {
+      task(req);
+    }
+  };
+  executor_t *executor =
+      __atomic_load_n(&fuse().deferrals->executor, __ATOMIC_ACQUIRE);
+  if (executor) {
+    executor->submit(run);
+  } else {
+    detail::spawn(run);
+  }
+}
+
+bool fuse_lowlevel::req_t::interrupted() {
+  return fuse_req_interrupted(fuse_req);
+}
+
+uid_t fuse_lowlevel::req_t::uid() { return fuse_req_ctx(fuse_req)->uid; }
+gid_t fuse_lowlevel::req_t::gid() { return fuse_req_ctx(fuse_req)->gid; }
+pid_t fuse_lowlevel::req_t::pid() { return fuse_req_ctx(fuse_req)->pid; }
+mode_t fuse_lowlevel::req_t::umask() { return fuse_req_ctx(fuse_req)->umask; }
+
+/* default operations, matching libfuse when an operation is missing */
+
+void fuse_lowlevel::init(struct fuse_conn_info *) {}
+void fuse_lowlevel::destroy() {}
+void fuse_lowlevel::lookup(req_t req, uint64_t, const char *) {
+  req.reply_err(ENOSYS);
+}
+void fuse_lowlevel::forget(req_t req, uint64_t, unsigned long) {
+  req.reply_none();
+}
+void fuse_lowlevel::getattr(req_t req, uint64_t, struct fuse_file_info *) {
+  req.reply_err(ENOSYS);
+}
+void fuse_lowlevel::setattr(req_t req, uint64_t, struct stat *, int,
+                            struct fuse_file_info *) {
+  req.reply_err(ENOSYS);
+}
+void fuse_lowlevel::readlink(req_t req, uint64_t) { req.reply_err(ENOSYS); }
+void fuse_lowlevel::mknod(req_t req, uint64_t, const char *, mode_t, dev_t) {
+  req.reply_err(ENOSYS);
+}
+void fuse_lowlevel::mkdir(req_t req, uint64_t, const char *, mode_t) {
+  req.reply_err(ENOSYS);
+}
+void fuse_lowlevel::unlink(req_t req, uint64_t, const char *) {
+  req.reply_err(ENOSYS);
+}
+void fuse_lowlevel::rmdir(req_t req, uint64_t, const char *) {
+  req.reply_err(ENOSYS);
+}
+void fuse_lowlevel::symlink(req_t req, const char *, uint64_t, const char *) {
+  req.reply_err(ENOSYS);
+}
+void fuse_lowlevel::rename(req_t req, uint64_t, const char *, uint64_t,
+                           const char *, unsigned int) {
+  req.reply_err(ENOSYS);
+}
+void fuse_lowlevel::link(req_t req, uint64_t, uint64_t, const char *) {
+  req.reply_err(ENOSYS);
+}
+void fuse_lowlevel::open(req_t req, uint64_t, struct fuse_file_info *fi) {
+  req.reply_open(fi);
+}
+void fuse_lowlevel::read(req_t req, uint64_t, size_t, off_t,
+                         struct fuse_file_info *) {
+  req.reply_err(ENOSYS);
+}
+void fuse_lowlevel::write(req_t req, uint64_t, const char *, size_t, off_t,
+                          struct fuse_file_info *) {
+  req.reply_err(ENOSYS);
+}
+void fuse_lowlevel::flush(req_t req, uint64_t, struct fuse_file_info *) {
+  req.reply_err(ENOSYS);
+}
+void fuse_lowlevel::release(req_t req, uint64_t, struct fuse_file_info *) {
+  req.reply_err(0);
+}
+void fuse_lowlevel::fsync(req_t req, uint64_t, int, struct fuse_file_info *) {
+  req.reply_err(ENOSYS);
+}
+void fuse_lowlevel::opendir(req_t req, uint64_t, struct fuse_file_info *fi) {
+  req.reply_open(fi);
+}
+void fuse_lowlevel::readdir(req_t req, uint64_t, size_t, off_t,
+                            struct fuse_file_info *) {
+  req.reply_err(ENOSYS);
+}
+void fuse_lowlevel::releasedir(req_t req, uint64_t, struct fuse_file_info *) {
+  req.reply_err(0);
+}
+void fuse_lowlevel::fsyncdir(req_t req, uint64_t, int,
+                             struct fuse_file_info *) {
+  req.reply_err(ENOSYS);
+}
+void fuse_lowlevel::statfs(req_t req, uint64_t) {
+  struct statvfs buf;
+  memset(&buf, 0, sizeof(buf));
+  buf.f_namemax = 255;
+  buf.f_bsize = 512;
+  req.reply_statfs(&buf);
+}
+void fuse_lowlevel::setxattr(req_t req, uint64_t, const char *, const char *,
+                             size_t, int) {
+  req.reply_err(ENOSYS);
+}
+void fuse_lowlevel::getxattr(req_t req, uint64_t, const char *, size_t) {
+  req.reply_err(ENOSYS);
+}
+void fuse_lowlevel::listxattr(req_t req, uint64_t, size_t) {
+  req.reply_err(ENOSYS);
+}
+void fuse_lowlevel::removexattr(req_t req, uint64_t, const char *) {
+  req.reply_err(ENOSYS);
+}
+void fuse_lowlevel::access(req_t req, uint64_t, int) { req.reply_err(ENOSYS); }
+void fuse_lowlevel::create(req_t req, uint64_t, const char *, mode_t,
+                           struct fuse_file_info *) {
+  req.reply_err(ENOSYS);
+}
+void fuse_lowlevel::getlk(req_t req, uint64_t, struct fuse_file_info *,
+                          struct flock *) {
+  req.reply_err(ENOSYS);
+}
+void fuse_lowlevel::setlk(req_t req, uint64_t, struct fuse_file_info *,
+                          struct flock *, int) {
+  req.reply_err(ENOSYS);
+}
+void fuse_lowlevel::bmap(req_t req, uint64_t, size_t, uint64_t) {
+  req.reply_err(ENOSYS);
+}
+void fuse_lowlevel::ioctl(req_t req, uint64_t, int, void *,
+                          struct fuse_file_info *, unsigned, const void *,
+                          size_t, size_t) {
+  req.reply_err(ENOSYS);
+}
+void fuse_lowlevel::poll(req_t req, uint64_t, struct fuse_file_info *,
+                         struct fuse_pollhandle *) {
+  req.reply_err(ENOSYS);
+}
+
+void fuse_lowlevel::write_buf(req_t req, uint64_t ino, struct fuse_bufvec *bufv,
+                              off_t off, struct fuse_file_info *fi) {
+  size_t size = fuse_buf_size(bufv);
+  struct fuse_buf &buf = bufv->buf[bufv->idx];
+  if (bufv->count - bufv->idx == 1 && !(buf.flags & FUSE_BUF_IS_FD)) {
+    write(req, ino, (char *)buf.mem + bufv->off, size, off, fi);
+    return;
+  }
+
+  // copy into memory, as libfuse does for filesystems without write_buf
+  struct fuse_bufvec membuf;
+  memset(&membuf, 0, sizeof(membuf));
+  membuf.count = 1;
+  membuf.buf[0].size = size;
+  membuf.buf[0].fd = -1;
+  membuf.buf[0].mem = malloc(size);
+  if (!membuf.buf[0].mem) {
+    req.reply_err(ENOMEM);
+    return;
+  }
+  ssize_t res = fuse_buf_copy(&membuf, bufv, (enum fuse_buf_copy_flags)0);
+  if (res < 0) {
+    req.reply_err(-res);
+  } else {
+    write(req, ino, (char *)membuf.buf[0].mem, res, off, fi);
+  }
+  free(membuf.buf[0].mem);
+}
+
+void fuse_lowlevel::retrieve_reply(req_t req, void *cookie, uint64_t,
+                                   off_t offset, struct fuse_bufvec *bufv) {
+  notifications_t::retrieve_t *callback =
+      static_cast<notifications_t::retrieve_t *>(cookie);
+  pthread_mutex_lock(&notifications->lock);
+  bool ours = notifications->retrieves.erase(callback);
+  pthread_mutex_unlock(&notifications->lock);
+  if (ours) {
+    (*callback)(offset, bufv);
+    delete callback;
+  }
+  req.reply_none();
+}
+
+void fuse_lowlevel::forget_multi(req_t req, size_t count,
+                                 struct fuse_forget_data *forgets) {
+  for (size_t i = 0; i < count; ++i) {
+    forget(req_t(), forgets[i].ino, forgets[i].nlookup);
+  }
+  req.reply_none();
+}
+
+void fuse_lowlevel::flock(req_t req, uint64_t, struct fuse_file_info *, int) {
+  req.reply_err(ENOSYS);
+}
+void fuse_lowlevel::fallocate(req_t req, uint64_t, int, off_t, off_t,
+                              struct fuse_file_info *) {
+  req.reply_err(ENOSYS);
+}
+void fuse_lowlevel::readdirplus(req_t req, uint64_t, size_t, off_t,
+                                struct fuse_file_info *) {
+  req.reply_err(ENOSYS);
+}
+
+/* executors */
+
+struct fuse_lowlevel::thread_pool_t::queue_t {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  std::deque<std::function<void()> > tasks;
+  std::vector<pthread_t> threads;
+  bool stopping;
+
+  static void *work(void *arg) {
+    queue_t *queue = static_cast<queue_t *>(arg);
+    pthread_mutex_lock(&queue->lock);
+    for (;;) {
+      if (queue->tasks.empty()) {
+        if (queue->stopping) {
+          break;
+        }
+        pthread_cond_wait(&queue->ready, &queue->lock);
+        continue;
+      }
+      std::function<void()> task;
+      task.swap(queue->tasks.front());
+      queue->tasks.pop_front();
+      pthread_mutex_unlock(&queue->lock);
+      task();
+      pthread_mutex_lock(&queue->lock);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+  }
+};
+
+fuse_lowlevel::thread_pool_t::thread_pool_t(size_t threads)
+    : queue(new queue_t) {
+  pthread_mutex_init(&queue->lock, 0);
+  pthread_cond_init(&queue->ready, 0);
+  queue->stopping = false;
+  for (size_t i = 0; i < threads; ++i) {
+    pthread_t thread;
+    if (pthread_create(&thread, 0, queue_t::work, queue) == 0) {
+      queue->threads.push_back(thread);
+    }
+  }
+}
+
+fuse_lowlevel::thread_pool_t::~thread_pool_t() {
+  pthread_mutex_lock(&queue->lock);
+  queue->stopping = true;
+  pthread_cond_broadcast(&queue->ready);
+  pthread_mutex_unlock(&queue->lock);
+  for (size_t i = 0; i < queue->threads.size(); ++i) {
+    pthread_join(queue->threads[i], 0);
+  }
+  pthread_cond_destroy(&queue->ready);
+  pthread_mutex_destroy(&queue->lock);
+  delete queue;
+}
+
+void fuse_lowlevel::thread_pool_t::submit(std::function<void()> task) {
+  pthread_mutex_lock(&queue->lock);
+  queue->tasks.push_back(task);
+  pthread_cond_signal(&queue->ready);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+void fuse_lowlevel::executor(executor_t *executor) {
+  __atomic_store_n(&deferrals->executor, executor, __ATOMIC_RELEASE);
+}
+
+void fuse_lowlevel::max_deferred(size_t limit) {
+  pthread_mutex_lock(&deferrals->lock);
+  deferrals->limit = limit;
+  pthread_cond_broadcast(&deferrals->replied);
+  pthread_mutex_unlock(&deferrals->lock);
+}
+
+size_t fuse_lowlevel::deferred() {
+  return __atomic_load_n(&deferrals->count, __ATOMIC_ACQUIRE);
+}
+
+void fuse_lowlevel::drain() {
+  pthread_mutex_lock(&deferrals->lock);
+  while (deferrals->count) {
+    pthread_cond_wait(&deferrals->replied, &deferrals->lock);
+  }
+  pthread_mutex_unlock(&deferrals->lock);
+}
+
+/* notifications */
+
+int fuse_lowlevel::notify_poll(struct fuse_pollhandle *ph) {
+  return fuse_lowlevel_notify_poll(ph);
+}
+
+void fuse_lowlevel::pollhandle_destroy(struct fuse_pollhandle *ph) {
+  fuse_pollhandle_destroy(ph);
+}
+
+int fuse_lowlevel::notify_inval_inode(uint64_t ino, off_t off, off_t len) {
+  return fuse_lowlevel_notify_inval_inode(session, ino, off, len);
+}
+
+int fuse_lowlevel::notify_inval_entry(uint64_t parent, const char *name) {
+  return fuse_lowlevel_notify_inval_entry(session, parent, name, strlen(name));
+}
+
+int fuse_lowlevel::notify_delete(uint64_t parent, uint64_t child,
+                                 const char *name) {
+  return fuse_lowlevel_notify_delete(session, parent, child, name,
+                                     strlen(name));
+}
+
+int fuse_lowlevel::notify_store(uint64_t ino, off_t offset,
+                                struct fuse_bufvec *bufv, int flags) {
+  return fuse_lowlevel_notify_store(session, ino, offset, bufv,
+                                    (enum fuse_buf_copy_flags)flags);
+}
+
+int fuse_lowlevel::notify_store(uint64_t ino, off_t offset, const char *buf,
+                                size_t size) {
+  struct fuse_bufvec bufv;
+  memset(&bufv, 0, sizeof(bufv));
+  bufv.count = 1;
+  bufv.buf[0].size = size;
+  bufv.buf[0].fd = -1;
+  bufv.buf[0].mem = const_cast<char *>(buf);
+  return notify_store(ino, offset, &bufv, 0);
+}
+
+int fuse_lowlevel::notify_retrieve(uint64_t ino, size_t size, off_t offset,
+                                   void *cookie) {
+  return fuse_lowlevel_notify_retrieve(session, ino, size, offset, cookie);
+}
+
+int fuse_lowlevel::notify_retrieve(
+    uint64_t ino, size_t size, off_t offset,
+    std::function<void(off_t offset, struct fuse_bufvec *bufv)> callback) {
+  notifications_t::retrieve_t *cookie =
+      new notifications_t::retrieve_t(callback);
+  pthread_mutex_lock(&notifications->lock);
+  notifications->retrieves.insert(cookie);
+  pthread_mutex_unlock(&notifications->lock);
+  int res = notify_retrieve(ino, size, offset, cookie);
+  if (res != 0) {
+    pthread_mutex_lock(&notifications->lock);
+    notifications->retrieves.erase(cookie);
+    pthread_mutex_unlock(&notifications->lock);
+    delete cookie;
+  }
+  return res;
+}
+
+void fuse_lowlevel::queue_inval_inode(uint64_t ino, off_t off, off_t len) {
+  pthread_mutex_lock(&notifications->lock);
+  std::pair<notifications_t::inodes_t::iterator, bool> it =
+      notifications->inodes.insert(
+          std::make_pair(ino, std::make_pair(off, len)));
+  if (!it.second) {
+    detail::merge(it.first->second, off, len);
+  }
+  detail::queued(*this);
+  pthread_mutex_unlock(&notifications->lock);
+}
+
+void fuse_lowlevel::queue_inval_entry(uint64_t parent,
+                                      const std::string &name) {
+  pthread_mutex_lock(&notifications->lock);
+  notifications->entries.insert(std::make_pair(parent, name));
+  detail::queued(*this);
+  pthread_mutex_unlock(&notifications->lock);
+}
+
+void fuse_lowlevel::flush_invals() {
+  pthread_mutex_lock(&notifications->lock);
+  while (!notifications->inodes.empty() || !notifications->entries.empty() ||
+         notifications->sending) {
+    pthread_cond_wait(&notifications->sent, &notifications->lock);
+  }
+  pthread_mutex_unlock(&notifications->lock);
+}
+
+/* session */
+
+const struct fuse_lowlevel_ops &fuse_lowlevel::operations() {
+  return detail::operations();
+}
+
+fuse_lowlevel::fuse_lowlevel()
+    : session(0), deferrals(new deferrals_t),
+      notifications(new notifications_t) {}
+
+fuse_lowlevel::fuse_lowlevel(struct fuse_args *args)
+    : session(fuse_session_new(args, &operations(),
+                               sizeof(struct fuse_lowlevel_ops), this)),
+      deferrals(new deferrals_t), notifications(new notifications_t) {}
+
+int fuse_lowlevel::mount(const char *mountpoint) {
+  if (!session) {
+    return -1;
+  }
+  return fuse_session_mount(session, mountpoint);
+}
+
+void fuse_lowlevel::unmount() { fuse_session_unmount(session); }
+void fuse_lowlevel::exit() { fuse_session_exit(session); }
+void fuse_lowlevel::reset() { fuse_session_reset(session); }
+bool fuse_lowlevel::exited() { return fuse_session_exited(session); }
+
+int fuse_lowlevel::loop() { return fuse_session_loop(session); }
+
+fuse_lowlevel::loop_config_t::loop_config_t()
+    : threads(0), clone_fd(false), max_idle_threads(0), executor(0) {}
+
+bool fuse_lowlevel::loop_config_t::fixed() const {
+  return threads || !cpus.empty() || executor;
+}
+
+bool fuse_lowlevel::loop_config_t::valid() const {
+  if (clone_fd && fixed()) {
+    fprintf(stderr, "fuse: clone_fd cannot be used with a fixed set of "
+                    "threads, cpus or an executor\n");
+    return false;
+  }
+  return true;
+}
+
+int fuse_lowlevel::loop_mt() { return loop_mt(session, loop_config); }
+
+int fuse_lowlevel::loop_mt(struct fuse_session *session,
+                           const loop_config_t &loop_config) {
+  if (!loop_config.valid()) {
+    return -1;
+  }
+  if (loop_config.fixed()) {
+    return detail::loop_readers(session, loop_config);
+  }
+#if FUSE_USE_VERSION < 32
+  return fuse_session_loop_mt(session, loop_config.clone_fd);
+#else  // FUSE_USE_VERSION < 32
+  struct fuse_loop_config config;
+  config.clone_fd = loop_config.clone_fd;
+  config.max_idle_threads =
+      loop_config.max_idle_threads ? loop_config.max_idle_threads : 10;
+  return fuse_session_loop_mt(session, &config);
+#endif
+}
+
+int fuse_lowlevel::main(int argc, char *argv[]) {
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  struct fuse_cmdline_opts opts;
+  int ret = 1;
+
+  if (fuse_parse_cmdline(&args, &opts) != 0) {
+    fuse_opt_free_args(&args);
+    return 1;
+  }
+  if (opts.show_help) {
+    printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
+    fuse_cmdline_help();
+    fuse_lowlevel_help();
+    ret = 0;
+  } else if (opts.show_version) {
+    printf("FUSE library version %s\n", fuse_pkgversion());
+    fuse_lowlevel_version();
+    ret = 0;
+  } else if (!opts.mountpoint) {
+    printf("usage: %s [options] <mountpoint>\n", argv[0]);
+    printf("       %s --help\n", argv[0]);
+  } else {
+    if (!session) {
+      session = fuse_session_new(&args, &operations(),
+                                 sizeof(struct fuse_lowlevel_ops), this);
+    }
+    if (opts.clone_fd) {
+      loop_config.clone_fd = true;
+    }
+#if FUSE_USE_VERSION >= 32
+    if (!loop_config.max_idle_threads) {
+      loop_config.max_idle_threads = opts.max_idle_threads;
+    }
+#endif
+    if (session && (opts.singlethread || loop_config.valid()) &&
+        fuse_set_signal_handlers(session) == 0) {
+      if (mount(opts.mountpoint) == 0) {
+        fuse_daemonize(opts.foreground);
+        ret = opts.singlethread ? loop() : loop_mt();
+        drain();
+        unmount();
+      }
+      fuse_remove_signal_handlers(session);
+    }
+  }
+
+  free(opts.mountpoint);
+  fuse_opt_free_args(&args);
+  return ret;
+}
+
+fuse_lowlevel::~fuse_lowlevel() {
+  // the invalidations still queued are sent first
+  pthread_mutex_lock(&notifications->lock);
+  notifications->stopping = true;
+  pthread_cond_signal(&notifications->queued);
+  pthread_mutex_unlock(&notifications->lock);
+  if (notifications->started) {
+    pthread_join(notifications->thread, 0);
+  }
+  delete notifications;
+
+  if (session) {
+    fuse_session_destroy(session);
+  }
+  delete deferrals;
+}
+
+#endif // FUSE_VERSION < 30
@@ -0,0 +1,1855 @@
+#include <fuse++_memfs>
+
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <set>
+#include <vector>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 30
+#endif
+
+#include <fuse.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#define thread_local _declspec(thread)
+#else
+#define thread_local __thread
+#endif
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE 0x02
+#endif
+#ifndef FALLOC_FL_ZERO_RANGE
+#define FALLOC_FL_ZERO_RANGE 0x10
+#endif
+#ifndef SEEK_DATA
+#define SEEK_DATA 3
+#endif
+#ifndef SEEK_HOLE
+#define SEEK_HOLE 4
+#endif
+
+static struct timespec now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts;
+}
+
+/* the page pool behind data_t */
+
+static const off_t max_size = std::numeric_limits<off_t>::max();
+
+// pages are carved from chunks of this many, and never given back
+static const size_t chunk_pages = 256;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+// free pages, each holding a pointer to the next
+static void *free_pages = 0;
+
+static char *pool_alloc(size_t page_size) {
+  pthread_mutex_lock(&pool_lock);
+  if (!free_pages) {
+    void *chunk;
+    if (posix_memalign(&chunk, page_size, chunk_pages * page_size) == 0) {
+      for (size_t idx = 0; idx < chunk_pages; ++idx) {
+        void *page = (char *)chunk + idx * page_size;
+        *(void **)page = free_pages;
+        free_pages = page;
+      }
+    }
+  }
+  void *page = free_pages;
+  if (page) {
+    free_pages = *(void **)page;
+  }
+  pthread_mutex_unlock(&pool_lock);
+  return (char *)page;
+}
+
+static void pool_free(char *page) {
+  pthread_mutex_lock(&pool_lock);
+  *(void **)page = free_pages;
+  free_pages = page;
+  pthread_mutex_unlock(&pool_lock);
+}
+
+/* the image behind a persistent memfs */
+
+// Page 0 holds two copies of the superblock, written in turn, so that
+// one is whole if writing the other is cut short.  Each sync writes the
+// tree to a run of free pages and then points the next superblock at
+// it; file data stays in the pages it was written to.
+struct image_super_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t page_size;
+  // of the image, including page 0
+  uint64_t pages;
+  // the copy with the higher one is current
+  uint64_t generation;
+  uint64_t tree_page;
+  uint64_t tree_bytes;
+  uint64_t tree_sum;
+  // of the fields above
+  uint64_t sum;
+};
+
+static const char image_magic[8] = {'f', 'u', 's', 'e', '+', '+', 'f', 's'};
+static const uint32_t image_version = 1;
+
+// FNV-1a
+static uint64_t checksum(const char *data, size_t size) {
+  uint64_t sum = UINT64_C(0xcbf29ce484222325);
+  for (size_t idx = 0; idx < size; ++idx) {
+    sum = (sum ^ (unsigned char)data[idx]) * UINT64_C(0x100000001b3);
+  }
+  return sum;
+}
+
+// The tree is a header, then every node reachable from the root once:
+// its record, the target of a link, the entries of a directory and the
+// runs of pages of a file.  Numbers are native, as the image is mapped
+// on the machine that wrote it.
+struct image_tree_t {
+  uint64_t next_ino;
+  uint64_t nodes;
+};
+
+struct image_node_t {
+  uint64_t ino;
+  uint64_t rdev;
+  int64_t size;
+  // atime, mtime and ctime, seconds then nanoseconds
+  int64_t times[6];
+  uint32_t mode;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t nlink;
+  uint64_t target;
+  uint64_t entries;
+  uint64_t runs;
+};
+
+// followed by the name
+struct image_entry_t {
+  uint64_t ino;
+  uint64_t name;
+};
+
+// pages of a file following on in both the file and the image
+struct image_run_t {
+  uint64_t number;
+  uint64_t page;
+  uint64_t count;
+};
+
+// The mapping, and the pages of it that are free.  Free pages are kept
+// as runs, so a fresh image is one run however large it is, and the tree
+// can be given contiguous pages.
+class memfs::image {
+public:
+  static const size_t page_size = data_t::page_size;
+
+  image()
+      : fd(-1), base(0), pages(0), generation(0), tree_page(0),
+        tree_pages(0), tree_bytes(0), free_count(0) {
+    pthread_mutex_init(&lock, 0);
+    pthread_mutex_init(&committing, 0);
+  }
+
+  ~image() {
+    if (base) {
+      munmap(base, pages * page_size);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+    pthread_mutex_destroy(&committing);
+    pthread_mutex_destroy(&lock);
+  }
+
+  // map the file, formatting it if empty; 'created' says which
+  int open(const char *path, off_t size, bool &created) {
+    fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+      return -errno;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      return -errno;
+    }
+    created = st.st_size == 0;
+    if (created) {
+      // page 0 and at least a page for the tree
+      if (size < (off_t)(2 * page_size)) {
+        return -EINVAL;
+      }
+      size -= size % page_size;
+      if (ftruncate(fd, size) != 0) {
+        return -errno;
+      }
+      st.st_size = size;
+    }
+    if (st.st_size < (off_t)(2 * page_size) ||
+        (uint64_t)st.st_size / page_size > SIZE_MAX / page_size) {
+      return -EINVAL;
+    }
+    pages = st.st_size / page_size;
+    void *map = mmap(0, pages * page_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+      return -errno;
+    }
+    base = static_cast<char *>(map);
+    dirty.assign((pages + 63) / 64, 0);
+    used.assign(pages, false);
+    used[0] = true;
+    if (created) {
+      return 0;
+    }
+
+    const image_super_t *current = 0;
+    for (int copy = 0; copy < 2; ++copy) {
+      const image_super_t *super = super_copy(copy);
+      if (valid(*super) && (!current || super->generation >
+                                             current->generation)) {
+        current = super;
+      }
+    }
+    if (!current) {
+      return -EINVAL;
+    }
+    generation = current->generation;
+    tree_page = current->tree_page;
+    tree_bytes = current->tree_bytes;
+    tree_pages = (tree_bytes + page_size - 1) / page_size;
+    if (tree_pages == 0 || !claim(tree_page, tree_pages)) {
+      return -EINVAL;
+    }
+    return 0;
+  }
+
+  // the tree last synced
+  const char *tree(size_t &bytes) const {
+    bytes = tree_bytes;
+    return base + tree_page * page_size;
+  }
+
+  char *page(uint64_t index) const { return base + index * page_size; }
+  uint64_t index(const char *page) const {
+    return (page - base) / page_size;
+  }
+
+  // while reading the tree back, mark pages as in use; false if any
+  // are past the end or already in use
+  bool claim(uint64_t first, uint64_t count) {
+    if (first >= pages || count > pages - first) {
+      return false;
+    }
+    for (uint64_t index = first; index < first + count; ++index) {
+      if (used[index]) {
+        return false;
+      }
+      used[index] = true;
+    }
+    return true;
+  }
+
+  // after reading the tree, free whatever it does not use
+  void start() {
+    for (uint64_t index = 0; index < pages;) {
+      uint64_t end = index;
+      while (end < pages && !used[end]) {
+        ++end;
+      }
+      if (end > index) {
+        runs.insert(std::make_pair(index, end - index));
+        free_count += end - index;
+      }
+      index = end + 1;
+    }
+    std::vector<bool>().swap(used);
+  }
+
+  // NULL once only the room kept for the next tree is left
+  char *alloc_page() {
+    pthread_mutex_lock(&lock);
+    char *result = 0;
+    if (free_count > kept()) {
+      uint64_t first = runs.begin()->first;
+      uint64_t count = runs.begin()->second;
+      runs.erase(runs.begin());
+      if (count > 1) {
+        runs.insert(std::make_pair(first + 1, count - 1));
+      }
+      --free_count;
+      result = page(first);
+    }
+    pthread_mutex_unlock(&lock);
+    return result;
+  }
+
+  // held back until the tree that may still use it is replaced
+  void free_page(char *page) {
+    pthread_mutex_lock(&lock);
+    released.push_back(index(page));
+    pthread_mutex_unlock(&lock);
+  }
+
+  void dirtied(const char *page) {
+    uint64_t number = index(page);
+    __atomic_or_fetch(&dirty[number / 64], UINT64_C(1) << (number % 64),
+                      __ATOMIC_RELAXED);
+  }
+
+  // the pages of the image, and those free for data
+  uint64_t total() const { return pages; }
+  uint64_t available() {
+    pthread_mutex_lock(&lock);
+    uint64_t count = free_count > kept() ? free_count - kept() : 0;
+    pthread_mutex_unlock(&lock);
+    return count;
+  }
+
+  // before taking the tree to commit; pages freed from here on may be
+  // in it, so stay held back
+  void begin() {
+    pthread_mutex_lock(&committing);
+    pthread_mutex_lock(&lock);
+    releasing.swap(released);
+    saving.clear();
+    pthread_mutex_unlock(&lock);
+  }
+
+  // a node's record in the tree, but for its runs; with the node locked
+  static void describe(const node_t *node, image_node_t &record) {
+    memset(&record, 0, sizeof(record));
+    record.ino = node->attr.st_ino;
+    record.rdev = node->attr.st_rdev;
+    record.size = node->data.length;
+    const struct timespec *times[3] = {
+        &node->attr.st_atim, &node->attr.st_mtim, &node->attr.st_ctim};
+    for (int time = 0; time < 3; ++time) {
+      record.times[time * 2] = times[time]->tv_sec;
+      record.times[time * 2 + 1] = times[time]->tv_nsec;
+    }
+    record.mode = node->attr.st_mode;
+    record.uid = node->attr.st_uid;
+    record.gid = node->attr.st_gid;
+    record.nlink = node->attr.st_nlink;
+    record.target = node->target.size();
+    record.entries = node->entries.size();
+  }
+
+  // from save(), with the node locked: the node as written to the tree
+  // being committed
+  void saved(const node_t *node, const image_node_t &record) {
+    synced_t state = synced_t::of(node, record);
+    pthread_mutex_lock(&lock);
+    saving[node] = state;
+    pthread_mutex_unlock(&lock);
+  }
+
+  // whether the tree last committed has the node as it is, apart from
+  // its times, so that its pages are all it needs written out; with
+  // the node locked
+  bool current(const node_t *node) {
+    image_node_t record;
+    describe(node, record);
+    synced_t state = synced_t::of(node, record);
+    pthread_mutex_lock(&lock);
+    std::map<const node_t *, synced_t>::iterator it = synced.find(node);
+    bool found = it != synced.end() &&
+                 memcmp(&it->second, &state, sizeof(state)) == 0;
+    pthread_mutex_unlock(&lock);
+    return found;
+  }
+
+  // msync the pages of a file written since they were last written
+  // out; with its node locked
+  int flush(const data_t &data) {
+    int result = 0;
+    uint64_t start = 0, count = 0;
+    for (data_t::pages_t::const_iterator it = data.pages.begin();
+         it != data.pages.end(); ++it) {
+      uint64_t number = index(it->second);
+      uint64_t bit = UINT64_C(1) << (number % 64);
+      if (!(__atomic_fetch_and(&dirty[number / 64], ~bit, __ATOMIC_RELAXED) &
+            bit)) {
+        continue;
+      }
+      if (count && start + count == number) {
+        ++count;
+        continue;
+      }
+      if (count && write_out(start, count) != 0) {
+        result = -EIO;
+      }
+      start = number;
+      count = 1;
+    }
+    if (count && write_out(start, count) != 0) {
+      result = -EIO;
+    }
+    return result;
+  }
+
+  // write out the dirty pages and the tree, then make the tree current
+  int commit(const std::string &tree) {
+    int result = flush();
+    uint64_t count = (tree.size() + page_size - 1) / page_size;
+    uint64_t first = 0;
+    if (result == 0) {
+      result = reserve(count, first) ? 0 : -ENOSPC;
+    }
+    if (result == 0) {
+      memcpy(page(first), tree.data(), tree.size());
+      result = write_out(first, count);
+    }
+    if (result == 0) {
+      image_super_t *super = super_copy((generation + 1) % 2);
+      memset(super, 0, sizeof(*super));
+      memcpy(super->magic, image_magic, sizeof(super->magic));
+      super->version = image_version;
+      super->page_size = page_size;
+      super->pages = pages;
+      super->generation = generation + 1;
+      super->tree_page = first;
+      super->tree_bytes = tree.size();
+      super->tree_sum = checksum(tree.data(), tree.size());
+      super->sum = checksum((const char *)super, offsetof(image_super_t, sum));
+      ++generation;
+      result = write_out(0, 1);
+    }
+
+    pthread_mutex_lock(&lock);
+    if (result == 0) {
+      // neither the old tree nor what was freed before it are needed now
+      give_back(tree_page, tree_pages);
+      tree_page = first;
+      tree_pages = count;
+      tree_bytes = tree.size();
+      for (size_t idx = 0; idx < releasing.size(); ++idx) {
+        give_back(releasing[idx], 1);
+      }
+      synced.swap(saving);
+    } else {
+      // the new tree's pages, if any, are lost until the next mount,
+      // as it may have become current after all; so may the nodes it
+      // has, or not
+      released.insert(released.end(), releasing.begin(), releasing.end());
+      synced.clear();
+    }
+    releasing.clear();
+    saving.clear();
+    pthread_mutex_unlock(&lock);
+    pthread_mutex_unlock(&committing);
+    return result;
+  }
+
+private:
+  image(const image &);
+  image &operator=(const image &);
+
+  // a node as last written to a tree, but for its times and runs
+  struct synced_t {
+    static synced_t of(const node_t *node, const image_node_t &record) {
+      synced_t state;
+      state.record = record;
+      memset(state.record.times, 0, sizeof(state.record.times));
+      state.record.runs = 0;
+      state.layout = node->data.layout;
+      return state;
+    }
+
+    image_node_t record;
+    // data_t::layout
+    uint64_t layout;
+  };
+
+  // Pages freed since the last sync cannot be reused until the next, so
+  // a sync needs room of its own for the tree or a full image could not
+  // be synced again.  Twice the last tree leaves room for it to grow.
+  uint64_t kept() const { return 2 * tree_pages + 1; }
+
+  image_super_t *super_copy(int copy) const {
+    return reinterpret_cast<image_super_t *>(base + copy * (page_size / 2));
+  }
+
+  bool valid(const image_super_t &super) const {
+    return memcmp(super.magic, image_magic, sizeof(super.magic)) == 0 &&
+           super.version == image_version && super.page_size == page_size &&
+           super.sum == checksum((const char *)&super,
+                                 offsetof(image_super_t, sum)) &&
+           super.pages == pages && super.tree_page < pages &&
+           super.tree_bytes <= (pages - super.tree_page) * page_size &&
+           super.tree_sum == checksum(page(super.tree_page), super.tree_bytes);
+  }
+
+  // take the first free run of 'count' pages
+  bool reserve(uint64_t count, uint64_t &first) {
+    pthread_mutex_lock(&lock);
+    std::map<uint64_t, uint64_t>::iterator it = runs.begin();
+    while (it != runs.end() && it->second < count) {
+      ++it;
+    }
+    bool found = it != runs.end();
+    if (found) {
+      first = it->first;
+      uint64_t left = it->second - count;
+      runs.erase(it);
+      if (left) {
+        runs.insert(std::make_pair(first + count, left));
+      }
+      free_count -= count;
+    }
+    pthread_mutex_unlock(&lock);
+    return found;
+  }
+
+  // free a run, merging it with its neighbours; with 'lock' held
+  void give_back(uint64_t first, uint64_t count) {
+    if (count == 0) {
+      return;
+    }
+    free_count += count;
+    std::map<uint64_t, uint64_t>::iterator next = runs.lower_bound(first);
+    if (next != runs.begin()) {
+      std::map<uint64_t, uint64_t>::iterator prev = next;
+      --prev;
+      if (prev->first + prev->second == first) {
+        first = prev->first;
+        count += prev->second;
+        runs.erase(prev);
+      }
+    }
+    if (next != runs.end() && first + count == next->first) {
+      count += next->second;
+      runs.erase(next);
+    }
+    runs.insert(std::make_pair(first, count));
+  }
+
+  // msync the pages written since the last flush, run by run
+  int flush() {
+    int result = 0;
+    uint64_t start = 0, count = 0;
+    for (size_t word = 0; word < dirty.size(); ++word) {
+      uint64_t bits = __atomic_exchange_n(&dirty[word], 0, __ATOMIC_RELAXED);
+      if (!bits) {
+        continue;
+      }
+      for (unsigned bit = 0; bit < 64; ++bit) {
+        if (!(bits & (UINT64_C(1) << bit))) {
+          continue;
+        }
+        uint64_t number = word * 64 + bit;
+        if (count && start + count == number) {
+          ++count;
+          continue;
+        }
+        if (count && write_out(start, count) != 0) {
+          result = -EIO;
+        }
+        start = number;
+        count = 1;
+      }
+    }
+    if (count && write_out(start, count) != 0) {
+      result = -EIO;
+    }
+    return result;
+  }
+
+  int write_out(uint64_t first, uint64_t count) {
+    // msync wants whole pages of the system's own size
+    static const uintptr_t system_page = sysconf(_SC_PAGESIZE);
+    uintptr_t from = (uintptr_t)page(first);
+    uintptr_t to = (uintptr_t)page(first + count);
+    from -= from % system_page;
+    return msync((void *)from, to - from, MS_SYNC) == 0 ? 0 : -EIO;
+  }
+
+  int fd;
+  char *base;
+  uint64_t pages;
+  uint64_t generation;
+  uint64_t tree_page;
+  uint64_t tree_pages;
+  uint64_t tree_bytes;
+  // one bit per page, set atomically
+  std::vector<uint64_t> dirty;
+  // while reading the tree back
+  std::vector<bool> used;
+
+  // guards the runs, the released pages and the nodes synced
+  pthread_mutex_t lock;
+  // first page to count, of the free runs
+  std::map<uint64_t, uint64_t> runs;
+  uint64_t free_count;
+  // the nodes as in the tree last committed, and in the one being
+  std::map<const node_t *, synced_t> synced;
+  std::map<const node_t *, synced_t> saving;
+  // pages freed since the last commit began, and before it
+  std::vector<uint64_t> released;
+  std::vector<uint64_t> releasing;
+  // one commit at a time, from begin() to the end of commit()
+  pthread_mutex_t committing;
+};
+
+char *memfs::data_t::alloc_page() {
+  ++layout;
+  return store ? store->alloc_page() : pool_alloc(page_size);
+}
+
+void memfs::data_t::free_page(char *page) {
+  ++layout;
+  if (store) {
+    store->free_page(page);
+  } else {
+    pool_free(page);
+  }
+}
+
+void memfs::data_t::dirtied(const char *page) {
+  if (store) {
+    store->dirtied(page);
+  }
+}
+
+memfs::data_t::data_t(image *store) : length(0), store(store), layout(0) {}
+
+memfs::data_t::~data_t() {
+  for (pages_t::iterator it = pages.begin(); it != pages.end(); ++it) {
+    free_page(it->second);
+  }
+}
+
+size_t memfs::data_t::read(char *buf, size_t count, off_t offset) const {
+  if (offset >= length) {
+    return 0;
+  }
+  if (count > (uint64_t)(length - offset)) {
+    count = length - offset;
+  }
+  uint64_t number = offset / page_size;
+  size_t skip = offset % page_size;
+  pages_t::const_iterator it = pages.lower_bound(number);
+  for (size_t done = 0; done < count; ++number, skip = 0) {
+    size_t part = page_size - skip < count - done ? page_size - skip
+                                                  : count - done;
+    if (it != pages.end() && it->first == number) {
+      memcpy(buf + done, it->second + skip, part);
+      ++it;
+    } else {
+      memset(buf + done, 0, part);
+    }
+    done += part;
+  }
+  return count;
+}
+
+int memfs::data_t::write(const char *buf, size_t count, off_t offset) {
+  if (offset < 0 || (uint64_t)offset + count > (uint64_t)max_size) {
+    return -EFBIG;
+  }
+  uint64_t number = offset / page_size;
+  size_t skip = offset % page_size;
+  pages_t::iterator it = pages.lower_bound(number);
+  size_t done = 0;
+  for (; done < count; ++number, skip = 0) {
+    size_t part = page_size - skip < count - done ? page_size - skip
+                                                  : count - done;
+    char *page;
+    if (it != pages.end() && it->first == number) {
+      page = it->second;
+      ++it;
+    } else {
+      page = alloc_page();
+      if (!page) {
+        break;
+      }
+      // zero what the write does not cover
+      memset(page, 0, skip);
+      memset(page + skip + part, 0, page_size - skip - part);
+      pages.insert(it, std::make_pair(number, page));
+    }
+    memcpy(page + skip, buf + done, part);
+    dirtied(page);
+    done += part;
+  }
+  if (done == 0 && count != 0) {
+    return -ENOSPC;
+  }
+  if (offset + (off_t)done > length) {
+    length = offset + done;
+  }
+  return done;
+}
+
+int memfs::data_t::truncate(off_t size) {
+  if (size < 0) {
+    return -EINVAL;
+  }
+  if (size < length) {
+    // to the very end, as pages may be allocated past the old size
+    punch(size, max_size - size);
+  }
+  length = size;
+  return 0;
+}
+
+int memfs::data_t::allocate(off_t offset, off_t len, bool keep_size) {
+  if (offset < 0 || len <= 0 || len > max_size - offset) {
+    return offset < 0 || len <= 0 ? -EINVAL : -EFBIG;
+  }
+  uint64_t last = (offset + len - 1) / page_size;
+  pages_t::iterator it = pages.lower_bound(offset / page_size);
+  for (uint64_t number = offset / page_size; number <= last; ++number) {
+    if (it != pages.end() && it->first == number) {
+      ++it;
+      continue;
+    }
+    char *page = alloc_page();
+    if (!page) {
+      return -ENOSPC;
+    }
+    memset(page, 0, page_size);
+    dirtied(page);
+    pages.insert(it, std::make_pair(number, page));
+  }
+  if (!keep_size && offset + len > length) {
+    length = offset + len;
+  }
+  return 0;
+}
+
+void memfs::data_t::punch(off_t offset, off_t len) {
+  if (offset < 0 || len <= 0) {
+    return;
+  }
+  off_t end = len > max_size - offset ? max_size : offset + len;
+  pages_t::iterator it = pages.lower_bound(offset / page_size);
+  while (it != pages.end() && (off_t)(it->first * page_size) < end) {
+    off_t start = it->first * page_size;
+    off_t from = offset > start ? offset - start : 0;
+    off_t to = end - start < (off_t)page_size ? end - start : page_size;
+    if (from == 0 && to == (off_t)page_size) {
+      free_page(it->second);
+      pages.erase(it++);
+    } else {
+      memset(it->second + from, 0, to - from);
+      dirtied(it->second);
+      ++it;
+    }
+  }
+}
+
+off_t memfs::data_t::seek(off_t offset, bool hole) const {
+  if (offset < 0 || offset >= length) {
+    return -ENXIO;
+  }
+  uint64_t number = offset / page_size;
+  pages_t::const_iterator it = pages.lower_bound(number);
+  if (!hole) {
+    if (it == pages.end()) {
+      return -ENXIO;
+    }
+    off_t found = (off_t)(it->first * page_size);
+    found = found > offset ? found : offset;
+    return found < length ? found : -ENXIO;
+  }
+  // past the pages that follow on from the offset's own
+  while (it != pages.end() && it->first == number) {
+    ++it;
+    ++number;
+  }
+  off_t found = (off_t)(number * page_size);
+  found = found > offset ? found : offset;
+  return found < length ? found : length;
+}
+
+/* locking */
+
+// A reader/writer lock split into one lock per slot.  Each thread reads
+// through the slot it was given, so readers on different cores share no
+// cache lines; a writer takes every slot in turn.
+class memfs::tree_lock {
+public:
+  static const size_t slots = 64;
+
+  tree_lock() {
+    for (size_t idx = 0; idx < slots; ++idx) {
+      pthread_rwlock_init(&slot[idx].lock, 0);
+    }
+  }
+  ~tree_lock() {
+    for (size_t idx = 0; idx < slots; ++idx) {
+      pthread_rwlock_destroy(&slot[idx].lock);
+    }
+  }
+
+  size_t read_lock() {
+    size_t idx = thread_slot();
+    pthread_rwlock_rdlock(&slot[idx].lock);
+    return idx;
+  }
+  void read_unlock(size_t idx) { pthread_rwlock_unlock(&slot[idx].lock); }
+
+  void write_lock() {
+    for (size_t idx = 0; idx < slots; ++idx) {
+      pthread_rwlock_wrlock(&slot[idx].lock);
+    }
+  }
+  void write_unlock() {
+    for (size_t idx = slots; idx > 0; --idx) {
+      pthread_rwlock_unlock(&slot[idx - 1].lock);
+    }
+  }
+
+private:
+  // threads take the slots in turn
+  static size_t thread_slot() {
+    static size_t next_slot = 0;
+    static thread_local size_t slot_plus_one = 0;
+    if (!slot_plus_one) {
+      slot_plus_one =
+          __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED) % slots + 1;
+    }
+    return slot_plus_one - 1;
+  }
+
+  // a cache line or two each
+  union slot_t {
+    pthread_rwlock_t lock;
+    char line[128];
+  };
+  slot_t slot[slots];
+};
+
+memfs::reading::reading(const memfs &fs) : fs(fs), slot(fs.tree->read_lock()) {}
+memfs::reading::~reading() { fs.tree->read_unlock(slot); }
+
+memfs::writing::writing(const memfs &fs) : fs(fs) { fs.tree->write_lock(); }
+memfs::writing::~writing() { fs.tree->write_unlock(); }
+
+class memfs::node_reading {
+public:
+  node_reading(node_t *node) : node(node) {
+    pthread_rwlock_rdlock(&node->lock);
+  }
+  ~node_reading() { pthread_rwlock_unlock(&node->lock); }
+
+private:
+  node_t *node;
+};
+
+class memfs::node_writing {
+public:
+  node_writing(node_t *node) : node(node) {
+    pthread_rwlock_wrlock(&node->lock);
+  }
+  ~node_writing() { pthread_rwlock_unlock(&node->lock); }
+
+private:
+  node_t *node;
+};
+
+memfs::node_t::node_t(image *store) : parent(0), data(store), opens(0) {
+  pthread_rwlock_init(&lock, 0);
+  memset(&attr, 0, sizeof(attr));
+}
+
+memfs::node_t::~node_t() { pthread_rwlock_destroy(&lock); }
+
+/* open files */
+
+// reads and writes go straight to the node
+class memfs::file_handle : public handle_t {
+public:
+  // with the tree locked
+  file_handle(memfs &fs, node_t *node) : node(node), fs(fs) {
+    __atomic_add_fetch(&node->opens, 1, __ATOMIC_RELAXED);
+  }
+  ~file_handle() { fs.closed(node); }
+
+  int read(char *buf, size_t count, off_t offset, struct fuse_file_info *) {
+    reading tree(fs);
+    node_reading lock(node);
+    return node->data.read(buf, count, offset);
+  }
+
+  int write(const char *buf, size_t count, off_t offset,
+            struct fuse_file_info *) {
+    reading tree(fs);
+    node_writing lock(node);
+    int result = node->data.write(buf, count, offset);
+    if (result > 0) {
+      node->attr.st_mtim = node->attr.st_ctim = now();
+    }
+    return result;
+  }
+
+  int fsync(int, struct fuse_file_info *) { return fs.sync_node(node); }
+
+  node_t *const node;
+
+private:
+  memfs &fs;
+};
+
+// lists ".", ".." and then the entries, resuming after the last name
+class memfs::dir_handle : public dir_handle_t {
+public:
+  // with the tree locked
+  dir_handle(memfs &fs, node_t *node) : node(node), fs(fs), dots(0) {
+    __atomic_add_fetch(&node->opens, 1, __ATOMIC_RELAXED);
+  }
+  ~dir_handle() { fs.closed(node); }
+
+  // the tree stays locked for the whole buffer
+  int readdir(off_t off, struct fuse_file_info *fi, readdir_flags flags) {
+    reading tree(fs);
+    return dir_handle_t::readdir(off, fi, flags);
+  }
+
+  int fsync(int, struct fuse_file_info *) { return fs.sync_image(); }
+
+  node_t *const node;
+
+protected:
+  void rewind() {
+    dots = 0;
+    last.clear();
+  }
+
+  int next(std::string &name, struct stat *stbuf, readdir_flags) {
+    if (dots < 2) {
+      name = dots ? ".." : ".";
+      // the parent of a removed directory is unknown
+      fs.stat_node(dots && node->parent ? node->parent : node, stbuf);
+      ++dots;
+      return 1;
+    }
+    entries_t::iterator it = last.empty()
+                                 ? node->entries.begin()
+                                 : node->entries.upper_bound(path_t(last));
+    if (it == node->entries.end()) {
+      return 0;
+    }
+    last = it->second->name;
+    name = last;
+    fs.stat_node(it->second->node, stbuf);
+    return 1;
+  }
+
+private:
+  memfs &fs;
+  int dots;
+  // the last name listed, so the place survives changes in between
+  std::string last;
+};
+
+// the root gets 1, FUSE_ROOT_ID
+memfs::memfs()
+    : tree(new tree_lock), store(0), root_node(0), next_ino(1), nodes(0) {
+  config.use_ino = FLAG_ON;
+  flag_utime_omit_ok = 1;
+  root_node = make_node(S_IFDIR | 0755);
+  root_node->attr.st_uid = getuid();
+  root_node->attr.st_gid = getgid();
+  root_node->attr.st_nlink = 2;
+  root_node->parent = root_node;
+}
+
+memfs::~memfs() {
+  sync_image();
+  // depth first, without recursion
+  node_t *dir = root_node;
+  while (dir) {
+    if (!dir->entries.empty()) {
+      entries_t::iterator it = dir->entries.begin();
+      node_t *node = it->second->node;
+      if (S_ISDIR(node->attr.st_mode) && !node->entries.empty()) {
+        dir = node;
+      } else {
+        remove_entry(dir, it);
+      }
+    } else {
+      node_t *parent = dir == root_node ? 0 : dir->parent;
+      if (!parent) {
+        delete dir;
+      }
+      dir = parent;
+    }
+  }
+  delete store;
+  delete tree;
+}
+
+int memfs::lookup(path_t pathname, node_t *&node) const {
+  if (pathname.empty()) {
+    // an unlinked file, with nullpath_ok
+    return -ENOENT;
+  }
+  node = root_node;
+  const char *ptr = pathname.data();
+  const char *end = ptr + pathname.size();
+  while (ptr < end) {
+    if (*ptr == '/') {
+      ++ptr;
+      continue;
+    }
+    const char *stop = (const char *)memchr(ptr, '/', end - ptr);
+    if (!stop) {
+      stop = end;
+    }
+    if (!S_ISDIR(node->attr.st_mode)) {
+      return -ENOTDIR;
+    }
+    entries_t::const_iterator it = node->entries.find(path_t(ptr, stop - ptr));
+    if (it == node->entries.end()) {
+      return -ENOENT;
+    }
+    node = it->second->node;
+    ptr = stop;
+  }
+  return 0;
+}
+
+int memfs::lookup_parent(path_t pathname, node_t *&dir, path_t &name) const {
+  name = pathname.name();
+  if (name.empty()) {
+    return pathname.empty() ? -ENOENT : -EBUSY;
+  }
+  if (name.size() > NAME_MAX) {
+    return -ENAMETOOLONG;
+  }
+  int result = lookup(pathname.parent(), dir);
+  if (result == 0 && !S_ISDIR(dir->attr.st_mode)) {
+    result = -ENOTDIR;
+  }
+  return result;
+}
+
+int memfs::find(path_t pathname, struct fuse_file_info *fi,
+                node_t *&node) const {
+  if (fi) {
+    handle_t *open = handle(fi);
+    if (file_handle *file = dynamic_cast<file_handle *>(open)) {
+      node = file->node;
+      return 0;
+    }
+    if (dir_handle *dir = dynamic_cast<dir_handle *>(open)) {
+      node = dir->node;
+      return 0;
+    }
+  }
+  return lookup(pathname, node);
+}
+
+memfs::node_t *memfs::make_node(mode_t mode) {
+  node_t *node = new node_t(store);
+  node->attr.st_ino = next_ino++;
+  node->attr.st_mode = mode;
+  node->attr.st_uid = context().uid;
+  node->attr.st_gid = context().gid;
+  node->attr.st_atim = node->attr.st_mtim = node->attr.st_ctim = now();
+  __atomic_add_fetch(&nodes, 1, __ATOMIC_RELAXED);
+  return node;
+}
+
+void memfs::add_entry(node_t *dir, path_t name, node_t *node) {
+  entry_t *entry = new entry_t(name, node);
+  dir->entries.insert(std::make_pair(path_t(entry->name), entry));
+  ++node->attr.st_nlink;
+  if (S_ISDIR(node->attr.st_mode)) {
+    // its "." and the parent's ".."
+    ++node->attr.st_nlink;
+    ++dir->attr.st_nlink;
+    node->parent = dir;
+  }
+  dir->attr.st_mtim = dir->attr.st_ctim = node->attr.st_ctim = now();
+}
+
+void memfs::remove_entry(node_t *dir, entries_t::iterator it) {
+  entry_t *entry = it->second;
+  node_t *node = entry->node;
+  dir->entries.erase(it);
+  delete entry;
+  unlinked(dir, node);
+}
+
+void memfs::unlinked(node_t *dir, node_t *node) {
+  --node->attr.st_nlink;
+  if (S_ISDIR(node->attr.st_mode)) {
+    --node->attr.st_nlink;
+    --dir->attr.st_nlink;
+    node->parent = 0;
+  }
+  dir->attr.st_mtim = dir->attr.st_ctim = node->attr.st_ctim = now();
+  drop(node);
+}
+
+void memfs::drop(node_t *node) {
+  if (node->attr.st_nlink == 0 &&
+      __atomic_load_n(&node->opens, __ATOMIC_RELAXED) == 0) {
+    delete node;
+    __atomic_sub_fetch(&nodes, 1, __ATOMIC_RELAXED);
+  }
+}
+
+void memfs::closed(node_t *node) {
+  // the link count cannot drop while the tree is locked for reading,
+  // and without names or handles nothing else can reach the node
+  reading tree(*this);
+  if (__atomic_sub_fetch(&node->opens, 1, __ATOMIC_ACQ_REL) == 0 &&
+      node->attr.st_nlink == 0) {
+    delete node;
+    __atomic_sub_fetch(&nodes, 1, __ATOMIC_RELAXED);
+  }
+}
+
+void memfs::reparent(node_t *node, node_t *from, node_t *to) {
+  if (S_ISDIR(node->attr.st_mode) && from != to) {
+    --from->attr.st_nlink;
+    ++to->attr.st_nlink;
+    node->parent = to;
+  }
+}
+
+bool memfs::inside(const node_t *dir, const node_t *node) const {
+  for (;; dir = dir->parent) {
+    if (dir == node) {
+      return true;
+    }
+    if (dir == root_node) {
+      return false;
+    }
+  }
+}
+
+int memfs::add_file(path_t pathname, mode_t mode,
+                    const std::string &content) {
+  writing tree(*this);
+  node_t *dir;
+  path_t name;
+  int result = lookup_parent(pathname, dir, name);
+  if (result != 0) {
+    return result;
+  }
+  if (dir->entries.count(name)) {
+    return -EEXIST;
+  }
+  node_t *node = make_node(S_IFREG | (mode & ~S_IFMT));
+  result = node->data.write(content.data(), content.size(), 0);
+  if (result < 0) {
+    drop(node);
+    return result;
+  }
+  add_entry(dir, name, node);
+  return 0;
+}
+
+void memfs::stat_node(node_t *node, struct stat *buf) const {
+  node_reading lock(node);
+  *buf = node->attr;
+  buf->st_blksize = data_t::page_size;
+  if (S_ISREG(node->attr.st_mode)) {
+    buf->st_size = node->data.size();
+    buf->st_blocks = node->data.allocated() * (data_t::page_size / 512);
+  } else if (S_ISLNK(node->attr.st_mode)) {
+    buf->st_size = node->target.size();
+  }
+}
+
+int memfs::getattr(path_t pathname, struct stat *buf,
+                   struct fuse_file_info *fi) {
+  reading tree(*this);
+  node_t *node;
+  int result = find(pathname, fi, node);
+  if (result == 0) {
+    stat_node(node, buf);
+  }
+  return result;
+}
+
+int memfs::readlink(path_t pathname, char *buffer, size_t size) {
+  reading tree(*this);
+  node_t *node;
+  int result = lookup(pathname, node);
+  if (result != 0) {
+    return result;
+  }
+  if (!S_ISLNK(node->attr.st_mode)) {
+    return -EINVAL;
+  }
+  if (size == 0) {
+    return 0;
+  }
+  size_t count =
+      node->target.size() < size - 1 ? node->target.size() : size - 1;
+  memcpy(buffer, node->target.data(), count);
+  buffer[count] = 0;
+  return 0;
+}
+
+int memfs::mknod(path_t pathname, mode_t mode, dev_t dev) {
+  writing tree(*this);
+  node_t *dir;
+  path_t name;
+  int result = lookup_parent(pathname, dir, name);
+  if (result != 0) {
+    return result;
+  }
+  if (dir->entries.count(name)) {
+    return -EEXIST;
+  }
+  if (S_ISDIR(mode) || S_ISLNK(mode)) {
+    return -EINVAL;
+  }
+  node_t *node = make_node(mode & S_IFMT ? mode : S_IFREG | mode);
+  node->attr.st_rdev = dev;
+  add_entry(dir, name, node);
+  return 0;
+}
+
+int memfs::mkdir(path_t pathname, mode_t mode) {
+  writing tree(*this);
+  node_t *dir;
+  path_t name;
+  int result = lookup_parent(pathname, dir, name);
+  if (result != 0) {
+    return result;
+  }
+  if (dir->entries.count(name)) {
+    return -EEXIST;
+  }
+  add_entry(dir, name, make_node(S_IFDIR | (mode & ~S_IFMT)));
+  return 0;
+}
+
+int memfs::unlink(path_t pathname) {
+  writing tree(*this);
+  node_t *dir;
+  path_t name;
+  int result = lookup_parent(pathname, dir, name);
+  if (result != 0) {
+    return result;
+  }
+  entries_t::iterator it = dir->entries.find(name);
+  if (it == dir->entries.end()) {
+    return -ENOENT;
+  }
+  if (S_ISDIR(it->second->node->attr.st_mode)) {
+    return -EISDIR;
+  }
+  remove_entry(dir, it);
+  return 0;
+}
+
+int memfs::rmdir(path_t pathname) {
+  writing tree(*this);
+  node_t *dir;
+  path_t name;
+  int result = lookup_parent(pathname, dir, name);
+  if (result != 0) {
+    return result;
+  }
+  entries_t::iterator it = dir->entries.find(name);
+  if (it == dir->entries.end()) {
+    return -ENOENT;
+  }
+  node_t *node = it->second->node;
+  if (!S_ISDIR(node->attr.st_mode)) {
+    return -ENOTDIR;
+  }
+  if (!node->entries.empty()) {
+    return -ENOTEMPTY;
+  }
+  remove_entry(dir, it);
+  return 0;
+}
+
+int memfs::symlink(path_t target, path_t linkpath) {
+  writing tree(*this);
+  node_t *dir;
+  path_t name;
+  int result = lookup_parent(linkpath, dir, name);
+  if (result != 0) {
+    return result;
+  }
+  if (dir->entries.count(name)) {
+    return -EEXIST;
+  }
+  node_t *node = make_node(S_IFLNK | 0777);
+  node->target = target.str();
+  add_entry(dir, name, node);
+  return 0;
+}
+
+int memfs::rename(path_t oldpath, path_t newpath, unsigned int flags) {
+  writing tree(*this);
+  if ((flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE)) ||
+      flags == (RENAME_NOREPLACE | RENAME_EXCHANGE)) {
+    return -EINVAL;
+  }
+  node_t *olddir, *newdir;
+  path_t oldname, newname;
+  int result = lookup_parent(oldpath, olddir, oldname);
+  if (result == 0) {
+    result = lookup_parent(newpath, newdir, newname);
+  }
+  if (result != 0) {
+    return result;
+  }
+  entries_t::iterator from = olddir->entries.find(oldname);
+  if (from == olddir->entries.end()) {
+    return -ENOENT;
+  }
+  entries_t::iterator to = newdir->entries.find(newname);
+  node_t *node = from->second->node;
+  node_t *target = to != newdir->entries.end() ? to->second->node : 0;
+  if (flags & RENAME_EXCHANGE) {
+    if (!target) {
+      return -ENOENT;
+    }
+  } else if (target && (flags & RENAME_NOREPLACE)) {
+    return -EEXIST;
+  }
+  if (target == node) {
+    // the same name, or two links to the same file
+    return 0;
+  }
+  if (S_ISDIR(node->attr.st_mode) && inside(newdir, node)) {
+    return -EINVAL;
+  }
+
+  // whatever the case, only the entries named change; nothing below a
+  // directory moves
+  if (flags & RENAME_EXCHANGE) {
+    if (S_ISDIR(target->attr.st_mode) && inside(olddir, target)) {
+      return -EINVAL;
+    }
+    from->second->node = target;
+    to->second->node = node;
+    reparent(target, newdir, olddir);
+    target->attr.st_ctim = now();
+  } else if (target) {
+    if (S_ISDIR(node->attr.st_mode) && !S_ISDIR(target->attr.st_mode)) {
+      return -ENOTDIR;
+    }
+    if (!S_ISDIR(node->attr.st_mode) && S_ISDIR(target->attr.st_mode)) {
+      return -EISDIR;
+    }
+    if (!target->entries.empty()) {
+      return -ENOTEMPTY;
+    }
+    // the target's entry takes the node, and the old one goes
+    to->second->node = node;
+    delete from->second;
+    olddir->entries.erase(from);
+    unlinked(newdir, target);
+  } else {
+    entry_t *entry = from->second;
+    olddir->entries.erase(from);
+    entry->name = newname.str();
+    newdir->entries.insert(std::make_pair(path_t(entry->name), entry));
+  }
+  reparent(node, olddir, newdir);
+  olddir->attr.st_mtim = olddir->attr.st_ctim = now();
+  newdir->attr.st_mtim = newdir->attr.st_ctim = node->attr.st_ctim = now();
+  return 0;
+}
+
+int memfs::link(path_t oldpath, path_t newpath) {
+  writing tree(*this);
+  node_t *node, *dir;
+  path_t name;
+  int result = lookup(oldpath, node);
+  if (result == 0) {
+    result = lookup_parent(newpath, dir, name);
+  }
+  if (result != 0) {
+    return result;
+  }
+  if (S_ISDIR(node->attr.st_mode)) {
+    return -EPERM;
+  }
+  if (dir->entries.count(name)) {
+    return -EEXIST;
+  }
+  add_entry(dir, name, node);
+  return 0;
+}
+
+int memfs::chmod(path_t pathname, mode_t mode, struct fuse_file_info *fi) {
+  // lookups read the file type from st_mode without the node's lock
+  writing tree(*this);
+  node_t *node;
+  int result = find(pathname, fi, node);
+  if (result == 0) {
+    node->attr.st_mode = (node->attr.st_mode & S_IFMT) | (mode & ~S_IFMT);
+    node->attr.st_ctim = now();
+  }
+  return result;
+}
+
+int memfs::chown(path_t pathname, uid_t uid, gid_t gid,
+                 struct fuse_file_info *fi) {
+  reading tree(*this);
+  node_t *node;
+  int result = find(pathname, fi, node);
+  if (result == 0) {
+    node_writing lock(node);
+    if (uid != (uid_t)-1) {
+      node->attr.st_uid = uid;
+    }
+    if (gid != (gid_t)-1) {
+      node->attr.st_gid = gid;
+    }
+    node->attr.st_ctim = now();
+  }
+  return result;
+}
+
+int memfs::truncate(path_t pathname, off_t length, struct fuse_file_info *fi) {
+  reading tree(*this);
+  node_t *node;
+  int result = find(pathname, fi, node);
+  if (result != 0) {
+    return result;
+  }
+  if (S_ISDIR(node->attr.st_mode)) {
+    return -EISDIR;
+  }
+  if (!S_ISREG(node->attr.st_mode)) {
+    return -EINVAL;
+  }
+  node_writing lock(node);
+  result = node->data.truncate(length);
+  if (result == 0) {
+    node->attr.st_mtim = node->attr.st_ctim = now();
+  }
+  return result;
+}
+
+int memfs::open(path_t pathname, struct fuse_file_info *fi) {
+  reading tree(*this);
+  node_t *node;
+  int result = lookup(pathname, node);
+  if (result != 0) {
+    return result;
+  }
+  return open_node(node, fi);
+}
+
+int memfs::open_node(node_t *node, struct fuse_file_info *fi) {
+  if (S_ISDIR(node->attr.st_mode)) {
+    return -EISDIR;
+  }
+  if ((fi->flags & O_TRUNC) && S_ISREG(node->attr.st_mode)) {
+    node_writing lock(node);
+    node->data.truncate(0);
+    node->attr.st_mtim = node->attr.st_ctim = now();
+  }
+  set_handle(fi, new file_handle(*this, node));
+  return 0;
+}
+
+int memfs::statfs(path_t, struct statvfs *buf) {
+  memset(buf, 0, sizeof(*buf));
+  buf->f_bsize = 4096;
+  buf->f_frsize = 4096;
+  buf->f_files = __atomic_load_n(&nodes, __ATOMIC_RELAXED);
+  buf->f_namemax = NAME_MAX;
+  if (store) {
+    buf->f_blocks = store->total();
+    buf->f_bfree = buf->f_bavail = store->available();
+  }
+  return 0;
+}
+
+int memfs::opendir(path_t pathname, struct fuse_file_info *fi) {
+  reading tree(*this);
+  node_t *node;
+  int result = lookup(pathname, node);
+  if (result != 0) {
+    return result;
+  }
+  if (!S_ISDIR(node->attr.st_mode)) {
+    return -ENOTDIR;
+  }
+  set_handle(fi, new dir_handle(*this, node));
+  return 0;
+}
+
+int memfs::create(path_t pathname, mode_t mode, struct fuse_file_info *fi) {
+  writing tree(*this);
+  node_t *dir;
+  path_t name;
+  int result = lookup_parent(pathname, dir, name);
+  if (result != 0) {
+    return result;
+  }
+  entries_t::iterator it = dir->entries.find(name);
+  if (it != dir->entries.end()) {
+    if (fi->flags & O_EXCL) {
+      return -EEXIST;
+    }
+    return open_node(it->second->node, fi);
+  }
+  node_t *node = make_node(S_IFREG | (mode & ~S_IFMT));
+  add_entry(dir, name, node);
+  set_handle(fi, new file_handle(*this, node));
+  return 0;
+}
+
+int memfs::utimens(path_t pathname, const struct timespec tv[2],
+                   struct fuse_file_info *fi) {
+  reading tree(*this);
+  node_t *node;
+  int result = find(pathname, fi, node);
+  if (result != 0) {
+    return result;
+  }
+  node_writing lock(node);
+  struct timespec ts = now();
+  struct timespec *times[2] = {&node->attr.st_atim, &node->attr.st_mtim};
+  for (int idx = 0; idx < 2; ++idx) {
+    if (!tv || tv[idx].tv_nsec == UTIME_NOW) {
+      *times[idx] = ts;
+    } else if (tv[idx].tv_nsec != UTIME_OMIT) {
+      *times[idx] = tv[idx];
+    }
+  }
+  node->attr.st_ctim = ts;
+  return 0;
+}
+
+int memfs::fallocate(path_t pathname, int mode, off_t offset, off_t len,
+                     struct fuse_file_info *fi) {
+  reading tree(*this);
+  node_t *node;
+  int result = find(pathname, fi, node);
+  if (result != 0) {
+    return result;
+  }
+  if (!S_ISREG(node->attr.st_mode)) {
+    return S_ISDIR(node->attr.st_mode) ? -EISDIR : -ENODEV;
+  }
+  if (offset < 0 || len <= 0) {
+    return -EINVAL;
+  }
+  bool keep_size = mode & FALLOC_FL_KEEP_SIZE;
+  node_writing lock(node);
+  switch (mode & ~FALLOC_FL_KEEP_SIZE) {
+  case 0:
+    result = node->data.allocate(offset, len, keep_size);
+    break;
+  case FALLOC_FL_PUNCH_HOLE:
+    if (!keep_size) {
+      return -EOPNOTSUPP;
+    }
+    node->data.punch(offset, len);
+    break;
+  case FALLOC_FL_ZERO_RANGE:
+    node->data.punch(offset, len);
+    result = node->data.allocate(offset, len, keep_size);
+    break;
+  default:
+    return -EOPNOTSUPP;
+  }
+  node->attr.st_mtim = node->attr.st_ctim = now();
+  return result;
+}
+
+off_t memfs::lseek(path_t pathname, off_t off, int whence,
+                   struct fuse_file_info *fi) {
+  reading tree(*this);
+  node_t *node;
+  int result = find(pathname, fi, node);
+  if (result != 0) {
+    return result;
+  }
+  if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+    return -EINVAL;
+  }
+  if (!S_ISREG(node->attr.st_mode)) {
+    return -ENXIO;
+  }
+  node_reading lock(node);
+  return node->data.seek(off, whence == SEEK_HOLE);
+}
+
+int memfs::fsync(path_t, int, struct fuse_file_info *) { return sync_image(); }
+
+int memfs::fsyncdir(path_t, int, struct fuse_file_info *) {
+  return sync_image();
+}
+
+/* keeping the tree in an image */
+
+template <class T> static void put(std::string &bytes, const T &value) {
+  bytes.append((const char *)&value, sizeof(value));
+}
+
+// reads the tree back, failing at its end
+class image_reader {
+public:
+  image_reader(const char *ptr, size_t size) : ptr(ptr), end(ptr + size) {}
+
+  template <class T> bool get(T &value) {
+    if ((size_t)(end - ptr) < sizeof(value)) {
+      return false;
+    }
+    memcpy(&value, ptr, sizeof(value));
+    ptr += sizeof(value);
+    return true;
+  }
+
+  bool get(std::string &value, uint64_t size) {
+    if ((uint64_t)(end - ptr) < size) {
+      return false;
+    }
+    value.assign(ptr, size);
+    ptr += size;
+    return true;
+  }
+
+  bool done() const { return ptr == end; }
+
+private:
+  const char *ptr;
+  const char *end;
+};
+
+int memfs::open_image(const std::string &path, off_t size) {
+  if (store || !root_node->entries.empty()) {
+    return -EBUSY;
+  }
+  image *opened = new image;
+  bool created = false;
+  int result = opened->open(path.c_str(), size, created);
+  if (result == 0 && !created) {
+    size_t bytes;
+    const char *tree_bytes = opened->tree(bytes);
+    store = opened;
+    result = restore(tree_bytes, bytes);
+  }
+  if (result == 0) {
+    opened->start();
+    store = opened;
+    root_node->data.store = store;
+    if (created) {
+      // with only the root, so there is a tree to mount next time
+      result = sync_image();
+    }
+  }
+  if (result != 0) {
+    store = 0;
+    root_node->data.store = 0;
+    delete opened;
+  }
+  return result;
+}
+
+int memfs::sync_image() {
+  if (!store) {
+    return 0;
+  }
+  store->begin();
+  std::string bytes;
+  {
+    reading lock(*this);
+    save(bytes);
+  }
+  return store->commit(bytes);
+}
+
+int memfs::sync_node(node_t *node) {
+  if (!store) {
+    return 0;
+  }
+  {
+    reading lock(*this);
+    node_reading node_lock(node);
+    if (store->current(node)) {
+      return store->flush(node->data);
+    }
+  }
+  return sync_image();
+}
+
+void memfs::save(std::string &bytes) const {
+  std::vector<node_t *> found(1, root_node);
+  // of files with more than one name
+  std::set<node_t *> linked;
+  image_tree_t header = {next_ino, 0};
+  put(bytes, header);
+  for (size_t idx = 0; idx < found.size(); ++idx) {
+    node_t *node = found[idx];
+    node_reading lock(node);
+    image_node_t record;
+    image::describe(node, record);
+
+    std::vector<image_run_t> runs;
+    const data_t::pages_t &pages = node->data.pages;
+    for (data_t::pages_t::const_iterator it = pages.begin();
+         it != pages.end(); ++it) {
+      uint64_t page = store->index(it->second);
+      if (!runs.empty() && runs.back().number + runs.back().count ==
+                               it->first &&
+          runs.back().page + runs.back().count == page) {
+        ++runs.back().count;
+      } else {
+        image_run_t run = {it->first, page, 1};
+        runs.push_back(run);
+      }
+    }
+    record.runs = runs.size();
+    store->saved(node, record);
+
+    put(bytes, record);
+    bytes.append(node->target);
+    for (entries_t::const_iterator it = node->entries.begin();
+         it != node->entries.end(); ++it) {
+      node_t *child = it->second->node;
+      image_entry_t entry = {(uint64_t)child->attr.st_ino,
+                             it->second->name.size()};
+      put(bytes, entry);
+      bytes.append(it->second->name);
+      if (S_ISDIR(child->attr.st_mode) || child->attr.st_nlink == 1 ||
+          linked.insert(child).second) {
+        found.push_back(child);
+      }
+    }
+    for (size_t run = 0; run < runs.size(); ++run) {
+      put(bytes, runs[run]);
+    }
+  }
+  header.nodes = found.size();
+  memcpy(&bytes[offsetof(image_tree_t, nodes)], &header.nodes,
+         sizeof(header.nodes));
+}
+
+int memfs::restore(const char *bytes, size_t size) {
+  image_reader in(bytes, size);
+  image_tree_t header;
+  if (!in.get(header)) {
+    return -EINVAL;
+  }
+  std::map<uint64_t, node_t *> read;
+  // directory, name and inode number, linked once all nodes are read
+  struct link_t {
+    node_t *dir;
+    std::string name;
+    uint64_t ino;
+  };
+  std::vector<link_t> links;
+  bool good = true;
+  for (uint64_t count = 0; good && count < header.nodes; ++count) {
+    image_node_t record;
+    if (!in.get(record) || read.count(record.ino) ||
+        record.ino >= header.next_ino) {
+      good = false;
+      break;
+    }
+    node_t *node = new node_t(store);
+    read[record.ino] = node;
+    node->attr.st_ino = record.ino;
+    node->attr.st_rdev = record.rdev;
+    struct timespec *times[3] = {&node->attr.st_atim, &node->attr.st_mtim,
+                                 &node->attr.st_ctim};
+    for (int time = 0; time < 3; ++time) {
+      times[time]->tv_sec = record.times[time * 2];
+      times[time]->tv_nsec = record.times[time * 2 + 1];
+    }
+    node->attr.st_mode = record.mode;
+    node->attr.st_uid = record.uid;
+    node->attr.st_gid = record.gid;
+    node->attr.st_nlink = record.nlink;
+    node->data.length = record.size;
+    good = record.size >= 0 && in.get(node->target, record.target);
+    for (uint64_t entry = 0; good && entry < record.entries; ++entry) {
+      image_entry_t named;
+      link_t link = {node, std::string(), 0};
+      good = in.get(named) && named.name > 0 && named.name <= NAME_MAX &&
+             in.get(link.name, named.name);
+      link.ino = named.ino;
+      links.push_back(link);
+    }
+    for (uint64_t run = 0; good && run < record.runs; ++run) {
+      image_run_t pages;
+      good = in.get(pages) && pages.count > 0 &&
+             pages.number + pages.count > pages.number &&
+             store->claim(pages.page, pages.count);
+      for (uint64_t page = 0; good && page < pages.count; ++page) {
+        node->data.pages.insert(std::make_pair(
+            pages.number + page, store->page(pages.page + page)));
+      }
+    }
+  }
+  // FUSE_ROOT_ID
+  std::map<uint64_t, node_t *>::iterator root = read.find(1);
+  good = good && in.done() && root != read.end() &&
+         S_ISDIR(root->second->attr.st_mode);
+  for (size_t idx = 0; good && idx < links.size(); ++idx) {
+    link_t &link = links[idx];
+    std::map<uint64_t, node_t *>::iterator it = read.find(link.ino);
+    good = S_ISDIR(link.dir->attr.st_mode) && it != read.end() &&
+           it->second != root->second &&
+           !link.dir->entries.count(path_t(link.name));
+    if (good) {
+      entry_t *entry = new entry_t(path_t(link.name), it->second);
+      link.dir->entries.insert(std::make_pair(path_t(entry->name), entry));
+      if (S_ISDIR(it->second->attr.st_mode)) {
+        good = !it->second->parent;
+        it->second->parent = link.dir;
+      }
+    }
+  }
+
+  if (!good) {
+    for (std::map<uint64_t, node_t *>::iterator it = read.begin();
+         it != read.end(); ++it) {
+      node_t *node = it->second;
+      for (entries_t::iterator entry = node->entries.begin();
+           entry != node->entries.end(); ++entry) {
+        delete entry->second;
+      }
+      // the pages belong to the image
+      node->data.pages.clear();
+      delete node;
+    }
+    return -EINVAL;
+  }
+  delete root_node;
+  root_node = root->second;
+  root_node->parent = root_node;
+  next_ino = header.next_ino;
+  __atomic_store_n(&nodes, read.size(), __ATOMIC_RELAXED);
+  return 0;
+}
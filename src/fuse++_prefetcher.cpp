@@ -0,0 +1,175 @@
+#include <fuse++_prefetcher>
+
+#include <algorithm>
+#include <cstdlib>
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 30
+#endif
+
+#include <fuse_lowlevel.h>
+
+#if FUSE_VERSION >= 30
+
+// the most fetched and stored at once
+static const size_t chunk_size = 128 << 10;
+
+// sequential reads in a row before prefetching starts
+static const unsigned min_run = 2;
+
+prefetcher::prefetcher(fuse_lowlevel &fs, fetch_t fetch, size_t budget,
+                       size_t window)
+    : fs(fs), fetch(fetch), budget(budget), window(window), started(false),
+      stopping(false), reserved(0), stored_bytes(0), dropped_bytes(0) {
+  pthread_mutex_init(&lock, 0);
+  pthread_cond_init(&queued, 0);
+  started = pthread_create(&thread, 0, work, this) == 0;
+}
+
+prefetcher::~prefetcher() {
+  pthread_mutex_lock(&lock);
+  stopping = true;
+  pthread_cond_signal(&queued);
+  pthread_mutex_unlock(&lock);
+  if (started) {
+    pthread_join(thread, 0);
+  }
+  pthread_cond_destroy(&queued);
+  pthread_mutex_destroy(&lock);
+}
+
+void prefetcher::read(uint64_t ino, uint64_t fh, off_t off, size_t size) {
+  pthread_mutex_lock(&lock);
+  std::map<uint64_t, stream_t>::iterator it = streams.find(fh);
+  if (it == streams.end()) {
+    stream_t stream = {ino, off, off, 0};
+    it = streams.insert(std::make_pair(fh, stream)).first;
+  }
+  stream_t &stream = it->second;
+  // reads of what was prefetched come from the cache, and are skipped
+  if (stream.ino == ino && off >= stream.next && off <= stream.ahead) {
+    ++stream.run;
+  } else {
+    // a seek, so what was prefetched may not be wanted
+    stream.ino = ino;
+    stream.run = 1;
+    stream.ahead = off;
+  }
+  stream.next = off + size;
+  if (stream.ahead < stream.next) {
+    stream.ahead = stream.next;
+  }
+
+  if (stream.run >= min_run) {
+    off_t end = stream.next + window;
+    while (stream.ahead < end) {
+      size_t len = std::min((off_t)chunk_size, end - stream.ahead);
+      if (!queue(ino, stream.ahead, len)) {
+        // tried again on the next read
+        break;
+      }
+      stream.ahead += len;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void prefetcher::release(uint64_t fh) {
+  pthread_mutex_lock(&lock);
+  streams.erase(fh);
+  pthread_mutex_unlock(&lock);
+}
+
+void prefetcher::invalidate(uint64_t ino) {
+  pthread_mutex_lock(&lock);
+  // without jobs on the inode, there is nothing to tell them
+  std::map<uint64_t, inode_t>::iterator it = inodes.find(ino);
+  if (it != inodes.end()) {
+    ++it->second.generation;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+bool prefetcher::prefetch(uint64_t ino, off_t off, size_t size) {
+  pthread_mutex_lock(&lock);
+  bool queued = true;
+  while (size && queued) {
+    size_t chunk = std::min(size, chunk_size);
+    queued = queue(ino, off, chunk);
+    off += chunk;
+    size -= chunk;
+  }
+  pthread_mutex_unlock(&lock);
+  return queued;
+}
+
+uint64_t prefetcher::stored() {
+  return __atomic_load_n(&stored_bytes, __ATOMIC_RELAXED);
+}
+
+uint64_t prefetcher::dropped() {
+  return __atomic_load_n(&dropped_bytes, __ATOMIC_RELAXED);
+}
+
+bool prefetcher::queue(uint64_t ino, off_t off, size_t size) {
+  if (!started || stopping || size > budget - reserved) {
+    __atomic_add_fetch(&dropped_bytes, size, __ATOMIC_RELAXED);
+    return false;
+  }
+  job_t job = {ino, off, size};
+  jobs.push_back(job);
+  ++inodes[ino].jobs;
+  reserved += size;
+  pthread_cond_signal(&queued);
+  return true;
+}
+
+void *prefetcher::work(void *arg) {
+  prefetcher &self = *static_cast<prefetcher *>(arg);
+  pthread_mutex_lock(&self.lock);
+  while (!self.stopping) {
+    if (self.jobs.empty()) {
+      pthread_cond_wait(&self.queued, &self.lock);
+      continue;
+    }
+    job_t job = self.jobs.front();
+    self.jobs.pop_front();
+    unsigned generation = self.inodes[job.ino].generation;
+    pthread_mutex_unlock(&self.lock);
+
+    ssize_t res = 0;
+    bool stored = false;
+    char *buf = static_cast<char *>(malloc(job.size));
+    if (buf) {
+      res = self.fetch(job.ino, buf, job.size, job.off);
+      pthread_mutex_lock(&self.lock);
+      bool changed = self.inodes[job.ino].generation != generation;
+      pthread_mutex_unlock(&self.lock);
+      // not stored with the lock held: the kernel can hold the pages
+      // locked while it waits on a write, which calls invalidate().
+      // fails for inodes the kernel has not cached, which is fine
+      if (res > 0 && !changed &&
+          self.fs.notify_store(job.ino, job.off, buf, res) == 0) {
+        __atomic_add_fetch(&self.stored_bytes, res, __ATOMIC_RELAXED);
+        stored = true;
+      }
+      free(buf);
+    }
+
+    pthread_mutex_lock(&self.lock);
+    std::map<uint64_t, inode_t>::iterator it = self.inodes.find(job.ino);
+    if (stored && it->second.generation != generation) {
+      // changed while being stored, so the data stored may be stale
+      // and the size extended past a truncation
+      self.fs.queue_inval_inode(job.ino, job.off, res);
+    }
+    if (!--it->second.jobs) {
+      self.inodes.erase(it);
+    }
+    self.reserved -= job.size;
+  }
+  pthread_mutex_unlock(&self.lock);
+  return 0;
+}
+
+#endif // FUSE_VERSION >= 30